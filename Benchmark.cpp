@@ -0,0 +1,423 @@
+// throughput and latency benchmark comparing the reference (OrderBook.cpp)
+// and the optimized (OrderBookOptimized.cpp) books on the same command
+// streams. build with optimizations:
+//
+//   g++ -std=c++20 -O3 -march=native -DNDEBUG Benchmark.cpp -o bench
+//   ./bench             run the synthetic flows
+//   ./bench flow.txt    also replay a recorded flow
+//
+// add -DORDERBOOK_STATS to also print the optimized book's own cycle counts
+// per operation (over every flow, including the generation runs)
+//
+// a recorded flow has one command per line: "L B|S price qty", "M B|S qty"
+// or "C id", where ids are the ones the books hand out (1, 2, ... in order)
+
+// both books define the same names, so each one is compiled into its own
+// namespace. the headers they use are included first, which turns their
+// own includes into no-ops inside the namespaces, so this list has to cover
+// every header either book includes
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <ostream>
+#include <set>
+#include <span>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#if defined(ORDERBOOK_STATS) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#elif defined(ORDERBOOK_STATS)
+#include <chrono>
+#endif
+
+namespace reference {
+#include "OrderBook.cpp"
+}
+namespace optimized {
+#include "OrderBookOptimized.cpp"
+#include "BookView.cpp"
+}
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+
+enum class OpType { LIMIT, MARKET, CANCEL };
+
+struct Op {
+  OpType type;
+  bool buy;
+  uint32_t price;
+  uint32_t qty;
+  uint64_t id;
+};
+
+// the first `prefill` ops build the starting book and are not timed
+struct Flow {
+  std::string name;
+  std::vector<Op> ops;
+  std::size_t prefill;
+};
+
+// log-linear latency histogram in the style of HdrHistogram: every power of
+// two is split into 2^subBits linear buckets, so a reported value is within
+// 1/2^subBits (about 3%) of the true one
+class LatencyHistogram {
+public:
+  LatencyHistogram() : counts_(65 * sub), count_{0}, max_{0} {}
+
+  void record(uint64_t value) {
+    ++counts_[index(value)];
+    ++count_;
+    max_ = std::max(max_, value);
+  }
+
+  uint64_t count() const { return count_; }
+  uint64_t max() const { return max_; }
+
+  uint64_t percentile(double p) const {
+    uint64_t rank = static_cast<uint64_t>(std::ceil(p / 100.0 * count_));
+    uint64_t seen = 0;
+    for (std::size_t i = 0; i < counts_.size(); ++i) {
+      seen += counts_[i];
+      if (seen >= rank && seen > 0)
+        return std::min(lowest(i), max_);
+    }
+    return max_;
+  }
+
+private:
+  static const int subBits = 5;
+  static const uint64_t sub = uint64_t{1} << subBits;
+
+  static std::size_t index(uint64_t value) {
+    if (value < sub)
+      return value;
+    int shift = std::bit_width(value) - 1 - subBits;
+    return (shift + 1) * sub + ((value >> shift) - sub);
+  }
+
+  static uint64_t lowest(std::size_t index) {
+    if (index < sub)
+      return index;
+    std::size_t shift = index / sub - 1;
+    return (sub + index % sub) << shift;
+  }
+
+  std::vector<uint64_t> counts_;
+  uint64_t count_;
+  uint64_t max_;
+};
+
+// mix and shape of one synthetic flow. prices are ticks around mid; a limit
+// crosses the spread with probability crossPct
+struct FlowSpec {
+  const char *name;
+  uint32_t limitPct;
+  uint32_t cancelPct;
+  uint32_t depthTicks;
+  uint32_t maxQty;
+  uint32_t maxMarketQty;
+  uint32_t crossPct;
+  std::size_t prefill;
+  std::size_t ops;
+};
+
+// generates a flow by driving an optimized book alongside, so cancels only
+// ever name orders that are still resting
+class FlowBuilder {
+public:
+  static const uint32_t mid = 1 << 15;
+
+  explicit FlowBuilder(const FlowSpec &spec, uint64_t seed)
+      : spec_{spec}, rng_{seed}, book_{}, remaining_{}, live_{} {}
+
+  Flow build() {
+    Flow flow{spec_.name, {}, spec_.prefill};
+    flow.ops.reserve(spec_.prefill + spec_.ops);
+    for (std::size_t i = 0; i < spec_.prefill; ++i)
+      flow.ops.push_back(limit(false));
+    for (std::size_t i = 0; i < spec_.ops; ++i) {
+      uint32_t roll = pick(100);
+      if (roll < spec_.limitPct)
+        flow.ops.push_back(limit(pick(100) < spec_.crossPct));
+      else if (roll < spec_.limitPct + spec_.cancelPct && !remaining_.empty())
+        flow.ops.push_back(cancel());
+      else
+        flow.ops.push_back(market());
+    }
+    return flow;
+  }
+
+private:
+  uint32_t pick(uint32_t n) { return rng_() % n; }
+
+  Op limit(bool cross) {
+    bool buy = pick(2);
+    uint32_t away = 1 + pick(spec_.depthTicks);
+    uint32_t price = buy == cross ? mid + away : mid - away;
+    Op op{OpType::LIMIT, buy, price, 1 + pick(spec_.maxQty), 0};
+    uint64_t id = nextId_++;
+    remaining_[id] = op.qty;
+    live_.push_back(id);
+    apply(op);
+    return op;
+  }
+
+  Op market() {
+    Op op{OpType::MARKET, static_cast<bool>(pick(2)), 0,
+          1 + pick(spec_.maxMarketQty), 0};
+    ++nextId_;
+    apply(op);
+    return op;
+  }
+
+  Op cancel() {
+    // live_ is pruned lazily: filled ids are dropped when picked
+    while (true) {
+      std::size_t at = pick(live_.size());
+      uint64_t id = live_[at];
+      live_[at] = live_.back();
+      live_.pop_back();
+      if (remaining_.erase(id)) {
+        Op op{OpType::CANCEL, false, 0, 0, id};
+        apply(op);
+        return op;
+      }
+    }
+  }
+
+  void apply(const Op &op) {
+    auto sink = [&](optimized::Trade trade) {
+      fill(trade.getBuy().id_, trade.getBuy().qty_);
+      fill(trade.getSell().id_, trade.getSell().qty_);
+    };
+    using optimized::Side;
+    Side side = op.buy ? Side::BUY : Side::SELL;
+    if (op.type == OpType::LIMIT)
+      book_.add_limit(side, op.price, op.qty, sink);
+    else if (op.type == OpType::MARKET)
+      book_.add_market(side, op.qty, sink);
+    else
+      book_.cancel(op.id);
+  }
+
+  void fill(uint64_t id, uint32_t qty) {
+    auto it = remaining_.find(id);
+    if (it == remaining_.end())
+      return;
+    it->second -= qty;
+    if (it->second == 0)
+      remaining_.erase(it);
+  }
+
+  FlowSpec spec_;
+  std::mt19937_64 rng_;
+  optimized::OrderBook book_;
+  std::unordered_map<uint64_t, uint32_t> remaining_;
+  std::vector<uint64_t> live_;
+  uint64_t nextId_{1};
+};
+
+Flow readFlow(const std::string &path) {
+  std::ifstream in(path);
+  if (!in)
+    throw std::runtime_error("cannot open " + path);
+  Flow flow{path, {}, 0};
+  std::string line;
+  while (std::getline(in, line)) {
+    std::istringstream fields(line);
+    char type = 0;
+    char side = 0;
+    Op op{};
+    fields >> type;
+    if (type == 'L') {
+      fields >> side >> op.price >> op.qty;
+      op.type = OpType::LIMIT;
+    } else if (type == 'M') {
+      fields >> side >> op.qty;
+      op.type = OpType::MARKET;
+    } else if (type == 'C') {
+      fields >> op.id;
+      op.type = OpType::CANCEL;
+    } else {
+      continue;
+    }
+    op.buy = side == 'B';
+    flow.ops.push_back(op);
+  }
+  return flow;
+}
+
+struct Result {
+  LatencyHistogram latency;
+  double seconds;
+  uint64_t trades;
+  uint64_t rejects;
+};
+
+// replays flow through apply(op), timing every op after the prefill. apply
+// returns the number of trades so the work cannot be optimized away. an op
+// the book rejects (e.g. a recorded cancel of a filled order) is counted
+template <typename Apply> Result run(const Flow &flow, Apply &&apply) {
+  using Clock = std::chrono::steady_clock;
+  Result result{{}, 0, 0, 0};
+  for (std::size_t i = 0; i < flow.prefill; ++i)
+    apply(flow.ops[i]);
+  auto begin = Clock::now();
+  for (std::size_t i = flow.prefill; i < flow.ops.size(); ++i) {
+    auto start = Clock::now();
+    try {
+      result.trades += apply(flow.ops[i]);
+    } catch (const std::exception &) {
+      ++result.rejects;
+    }
+    auto end = Clock::now();
+    result.latency.record(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+            .count());
+  }
+  result.seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+  return result;
+}
+
+Result runReference(const Flow &flow) {
+  using namespace reference;
+  auto book = std::make_unique<OrderBook>();
+  return run(flow, [&](const Op &op) -> uint64_t {
+    Side side = op.buy ? Side::BUY : Side::SELL;
+    switch (op.type) {
+    case OpType::LIMIT:
+      return book->add_limit(side, op.price, op.qty).size();
+    case OpType::MARKET:
+      return book->add_market(side, op.qty).size();
+    case OpType::CANCEL:
+      book->cancel(op.id);
+    }
+    return 0;
+  });
+}
+
+Result runOptimized(const Flow &flow) {
+  using namespace optimized;
+  auto book = std::make_unique<OrderBook>();
+  return run(flow, [&](const Op &op) -> uint64_t {
+    Side side = op.buy ? Side::BUY : Side::SELL;
+    switch (op.type) {
+    case OpType::LIMIT:
+      return book->add_limit(side, op.price, op.qty).size();
+    case OpType::MARKET:
+      return book->add_market(side, op.qty).size();
+    case OpType::CANCEL:
+      book->cancel(op.id);
+    }
+    return 0;
+  });
+}
+
+// the optimized book through its sink overloads, so no Trades are built
+// with view set, the book also publishes a BookView after every call
+template <typename Book = optimized::OrderBook>
+Result runOptimizedSink(const Flow &flow, bool view = false) {
+  using namespace optimized;
+  auto book = std::make_unique<Book>();
+  auto published = std::make_unique<BookView<Book>>();
+  if (view)
+    published->attach(*book);
+  uint64_t trades = 0;
+  auto count = [&](const typename Book::Trade &) { ++trades; };
+  return run(flow, [&](const Op &op) -> uint64_t {
+    Side side = op.buy ? Side::BUY : Side::SELL;
+    uint64_t before = trades;
+    switch (op.type) {
+    case OpType::LIMIT:
+      book->add_limit(side, op.price, op.qty, count);
+      break;
+    case OpType::MARKET:
+      book->add_market(side, op.qty, count);
+      break;
+    case OpType::CANCEL:
+      book->cancel(op.id);
+    }
+    return trades - before;
+  });
+}
+
+void report(const Flow &flow, const char *book, const Result &result) {
+  double mops = result.latency.count() / result.seconds / 1e6;
+  std::printf("%-14s %-16s %9lu %8.2f %7lu %7lu %7lu %9lu %9lu\n",
+              flow.name.c_str(), book, result.latency.count(), mops,
+              result.latency.percentile(50), result.latency.percentile(99),
+              result.latency.percentile(99.9), result.latency.max(),
+              result.trades);
+  if (result.rejects)
+    std::printf("%-14s %-16s %lu ops rejected\n", "", book, result.rejects);
+}
+
+void bench(const Flow &flow) {
+  report(flow, "reference", runReference(flow));
+  report(flow, "optimized", runOptimized(flow));
+  report(flow, "optimized+sink", runOptimizedSink(flow));
+  report(flow, "split+sink",
+         runOptimizedSink<optimized::BasicOrderBook<optimized::SplitPolicy>>(
+             flow));
+  report(flow, "hugepage+sink",
+         runOptimizedSink<
+             optimized::BasicOrderBook<optimized::HugePagePolicy>>(flow));
+  report(flow, "view+sink", runOptimizedSink(flow, true));
+}
+
+int main(int argc, char **argv) {
+  const FlowSpec specs[] = {
+      // name          limit cancel depth qty  mkt  cross prefill  ops
+      {"add-heavy", 80, 15, 50, 100, 100, 5, 10000, 1000000},
+      {"cancel-heavy", 40, 55, 50, 100, 100, 5, 10000, 1000000},
+      {"sweep-heavy", 50, 10, 20, 100, 2000, 2, 10000, 500000},
+      {"deep-book", 30, 60, 5000, 100, 500, 2, 1000000, 1000000},
+  };
+
+  std::printf("%-14s %-16s %9s %8s %7s %7s %7s %9s %9s\n", "flow", "book",
+              "ops", "Mops/s", "p50ns", "p99ns", "p99.9ns", "maxns", "trades");
+  for (const FlowSpec &spec : specs)
+    bench(FlowBuilder(spec, 42).build());
+  for (int i = 1; i < argc; ++i)
+    bench(readFlow(argv[i]));
+#ifdef ORDERBOOK_STATS
+  std::printf("\n");
+  optimized::dumpStats(std::cout);
+#endif
+}
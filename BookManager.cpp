@@ -0,0 +1,245 @@
+#pragma once
+
+#include "Sequencer.cpp"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using SymbolId = uint32_t;
+
+// owns the books for many symbols, split across shards that each run their
+// own matching thread. producers route commands by symbol through a routing
+// table, so every symbol's commands are applied by exactly one thread, in the
+// order each producer submitted them. books are built on their shard's
+// thread once it has been pinned, so their memory is first touched (and with
+// the default policy, placed) on that core's NUMA node
+template <typename Book = OrderBook> class BookManager {
+public:
+  using Command = typename Book::Command;
+  using Event = BasicEvent<Book>;
+
+  struct ShardEvent {
+    SymbolId symbol;
+    Event event;
+  };
+
+  BookManager(std::size_t numShards, std::size_t numProducers,
+              std::size_t maxSymbols,
+              std::size_t ringCapacity = defaultRingCapacity)
+      : shards_{}, route_(maxSymbols), epochs_(numProducers) {
+    for (std::size_t i = 0; i < numShards; ++i)
+      shards_.push_back(
+          std::make_unique<Shard>(numProducers, maxSymbols, ringCapacity));
+    for (auto &shard : route_)
+      shard.store(unrouted, std::memory_order_relaxed);
+  }
+
+  ~BookManager() { stop(); }
+
+  // registers a symbol on a shard before start(). bookArgs are passed to the
+  // Book constructor on the shard thread
+  template <typename... Args>
+  void add_symbol(SymbolId symbol, std::size_t shard, Args... bookArgs) {
+    if (symbol >= route_.size())
+      throw std::out_of_range("symbol id beyond maxSymbols");
+    if (route_[symbol].load(std::memory_order_relaxed) != unrouted)
+      throw std::logic_error("symbol already registered");
+    shards_.at(shard)->pending.emplace_back(
+        symbol, [=] { return std::make_unique<Book>(bookArgs...); });
+    route_[symbol].store(shard, std::memory_order_relaxed);
+  }
+
+  // starts every shard, pinning shard i to cpus[i] when one is given
+  void start(const std::vector<int> &cpus = {}) {
+    for (std::size_t i = 0; i < shards_.size(); ++i)
+      startShard(*shards_[i], i < cpus.size() ? cpus[i] : -1);
+  }
+
+  void stop() {
+    for (auto &shard : shards_)
+      stopShard(*shard);
+  }
+
+  // producer side: only the thread that owns `producer` may call this. returns
+  // false if the symbol is unknown or its shard's ring for this producer is
+  // full. the epoch brackets the routing read so rebalance() can tell when no
+  // producer still acts on a stale route
+  bool submit(std::size_t producer, SymbolId symbol, const Command &command,
+              uint64_t tag = 0) {
+    if (symbol >= route_.size())
+      return false;
+    std::atomic<uint64_t> &epoch = epochs_[producer].value;
+    epoch.fetch_add(1);
+    uint32_t shard = route_[symbol].load();
+    bool pushed = shard != unrouted &&
+                  shards_[shard]->ingress[producer]->try_push(
+                      Request{symbol, command, tag});
+    epoch.fetch_add(1, std::memory_order_release);
+    return pushed;
+  }
+
+  // consumer side of one shard's outbound ring
+  bool poll(std::size_t shard, ShardEvent &event) {
+    return shards_[shard]->outbound.try_pop(event);
+  }
+
+  std::size_t shard_of(SymbolId symbol) const {
+    return route_.at(symbol).load(std::memory_order_acquire);
+  }
+
+  std::size_t num_shards() const { return shards_.size(); }
+
+  // moves a running symbol to another shard. the target shard is paused
+  // first, so it cannot see the symbol's commands before it has its book;
+  // then the route is switched, producers are waited out of any submit that
+  // read the old route, and the source shard is drained and paused before its
+  // book changes hands. other symbols on the two shards stall meanwhile
+  void rebalance(SymbolId symbol, std::size_t shard) {
+    std::size_t from = shard_of(symbol);
+    if (from == unrouted)
+      throw std::out_of_range("unknown symbol");
+    if (from == shard)
+      return;
+    Shard &source = *shards_[from];
+    Shard &target = *shards_.at(shard);
+    if (!source.running.load() || !target.running.load())
+      throw std::logic_error("rebalance needs started shards");
+    int sourceCpu = source.cpu;
+    int targetCpu = target.cpu;
+
+    stopShard(target);
+    route_[symbol].store(shard);
+    waitForProducers();
+    stopShard(source);
+    target.books[symbol] = std::move(source.books[symbol]);
+    startShard(source, sourceCpu);
+    startShard(target, targetCpu);
+  }
+
+private:
+  static const std::size_t defaultRingCapacity = 1 << 14;
+  static constexpr uint32_t unrouted = std::numeric_limits<uint32_t>::max();
+
+  struct Request {
+    SymbolId symbol;
+    Command command;
+    uint64_t tag;
+  };
+
+  struct Shard {
+    Shard(std::size_t numProducers, std::size_t maxSymbols,
+          std::size_t ringCapacity)
+        : ingress{}, outbound{ringCapacity}, books(maxSymbols), pending{},
+          trades{} {
+      for (std::size_t i = 0; i < numProducers; ++i)
+        ingress.push_back(std::make_unique<SpscRing<Request>>(ringCapacity));
+    }
+
+    std::vector<std::unique_ptr<SpscRing<Request>>> ingress;
+    SpscRing<ShardEvent> outbound;
+    // indexed by symbol; null for symbols owned by other shards
+    std::vector<std::unique_ptr<Book>> books;
+    std::vector<std::pair<SymbolId, std::function<std::unique_ptr<Book>()>>>
+        pending;
+    typename Book::Trades trades;
+    uint64_t nextSeq{0};
+    int cpu{-1};
+    std::atomic<bool> running{false};
+    std::thread thread;
+  };
+
+  // each on its own cache line, written only by its producer
+  struct alignas(64) Epoch {
+    std::atomic<uint64_t> value{0};
+  };
+
+  void startShard(Shard &shard, int cpu) {
+    shard.cpu = cpu;
+    shard.running.store(true, std::memory_order_release);
+    shard.thread = std::thread([this, &shard, cpu] {
+      if (cpu >= 0)
+        pinThread(cpu);
+      for (auto &[symbol, make] : shard.pending)
+        shard.books[symbol] = make();
+      shard.pending.clear();
+      while (shard.running.load(std::memory_order_acquire)) {
+        if (drain(shard) == 0) {
+          // idle: let the shard's books grow ahead of demand
+          for (auto &book : shard.books)
+            if (book)
+              book->maintain();
+          std::this_thread::yield();
+        }
+      }
+      while (drain(shard) != 0) {
+      }
+    });
+  }
+
+  void stopShard(Shard &shard) {
+    shard.running.store(false, std::memory_order_release);
+    if (shard.thread.joinable())
+      shard.thread.join();
+  }
+
+  // spins until every producer that was inside submit() has left it
+  void waitForProducers() {
+    for (auto &epoch : epochs_) {
+      uint64_t seen = epoch.value.load();
+      if (seen % 2 == 0)
+        continue;
+      while (epoch.value.load(std::memory_order_acquire) == seen)
+        std::this_thread::yield();
+    }
+  }
+
+  std::size_t drain(Shard &shard) {
+    std::size_t applied = 0;
+    Request request;
+    for (auto &ring : shard.ingress) {
+      if (!ring->try_pop(request))
+        continue;
+      apply(shard, request);
+      ++applied;
+    }
+    return applied;
+  }
+
+  void apply(Shard &shard, const Request &request) {
+    uint64_t seq = shard.nextSeq++;
+    Book *book = shard.books[request.symbol].get();
+    shard.trades.clear();
+    try {
+      if (!book)
+        throw std::logic_error("symbol not owned by this shard");
+      auto id = book->execute(request.command, AppendTrades{shard.trades});
+      EventType type = request.command.type == CommandType::CANCEL
+                           ? EventType::CANCELLED
+                           : EventType::ACCEPTED;
+      publish(shard, request.symbol,
+              Event{type, seq, request.tag, id, {}, {}, shard.trades.empty()});
+    } catch (const std::exception &) {
+      publish(shard, request.symbol,
+              Event{EventType::REJECTED, seq, request.tag, 0, {}, {},
+                    shard.trades.empty()});
+    }
+    auto &trades = shard.trades;
+    for (std::size_t i = 0; i < trades.size(); ++i)
+      publish(shard, request.symbol,
+              Event{EventType::TRADE, seq, request.tag, 0, trades[i].getBuy(),
+                    trades[i].getSell(), i + 1 == trades.size()});
+  }
+
+  void publish(Shard &shard, SymbolId symbol, const Event &event) {
+    while (!shard.outbound.try_push(ShardEvent{symbol, event}))
+      std::this_thread::yield();
+  }
+
+  std::vector<std::unique_ptr<Shard>> shards_;
+  std::vector<std::atomic<uint32_t>> route_;
+  std::vector<Epoch> epochs_;
+};
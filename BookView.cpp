@@ -0,0 +1,226 @@
+#pragma once
+
+// read-only views of a book for threads other than the matching thread:
+// risk, analytics, a UI. the matching thread publishes, after every call
+// that changed the book, the top levels of each side as one record and the
+// state of each order it changed into that order's slot. every record sits
+// behind its own seqlock, so the writer never waits for a reader and a
+// reader never writes anything the matching thread reads: a read costs the
+// matching thread nothing, however many threads poll.
+//
+// a read is a copy bracketed by two loads of the record's sequence number.
+// it is retried if a publish overlapped it, which try_... reports instead
+// of retrying, so a reader that must not spin can poll those
+
+#include "OrderBookOptimized.cpp"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <span>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// one record of T with a single writer and any number of readers. the record
+// is kept as relaxed atomic words, so a read that races a store is a retry
+// rather than a data race. the sequence number is odd while a store is in
+// progress and counts two per store
+template <typename T> class Seqlock {
+  static_assert(std::is_trivially_copyable_v<T>);
+
+public:
+  // writer side: one thread only
+  void store(const T &value) {
+    uint64_t words[wordCount] = {};
+    std::memcpy(words, &value, sizeof(T));
+    uint64_t seq = seq_.load(std::memory_order_relaxed);
+    seq_.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (std::size_t i = 0; i < wordCount; ++i)
+      words_[i].store(words[i], std::memory_order_relaxed);
+    seq_.store(seq + 2, std::memory_order_release);
+  }
+
+  // one attempt at a read. false if a store overlapped it, leaving out as
+  // it was
+  bool try_load(T &out) const {
+    uint64_t before = seq_.load(std::memory_order_acquire);
+    if (before & 1)
+      return false;
+    uint64_t words[wordCount];
+    for (std::size_t i = 0; i < wordCount; ++i)
+      words[i] = words_[i].load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (seq_.load(std::memory_order_relaxed) != before)
+      return false;
+    std::memcpy(&out, words, sizeof(T));
+    return true;
+  }
+
+  // reads until no store overlaps. the writer only holds a record for the
+  // length of one copy, so this retries rarely, but it yields in case the
+  // writer was descheduled mid-store
+  T load() const {
+    T out{};
+    while (!try_load(out))
+      std::this_thread::yield();
+    return out;
+  }
+
+private:
+  static constexpr std::size_t wordCount = (sizeof(T) + 7) / 8;
+
+  std::atomic<uint64_t> seq_{0};
+  std::atomic<uint64_t> words_[wordCount] = {};
+};
+
+// the published side of one book, showing the best Depth levels of each side
+// and the latest state of recent orders. the order slots are a power-of-two
+// window indexed by id, as in DirectIdIndex: ids are handed out in order, so
+// an order keeps its slot until an id orderSlots later takes it over, and
+// the view then forgets it
+template <typename Book, std::size_t Depth = 10> class BookView {
+public:
+  using OrderId = typename Book::OrderId;
+  using DepthLevel = typename Book::DepthLevel;
+  using TopOfBook = typename Book::TopOfBook;
+  using OrderState = typename Book::OrderState;
+
+  // the top of the book as of one publish. version goes up with every
+  // publish, so a reader can tell whether anything changed since its last
+  // look
+  struct Levels {
+    uint64_t version;
+    uint32_t bidCount;
+    uint32_t askCount;
+    DepthLevel bids[Depth];
+    DepthLevel asks[Depth];
+  };
+
+  explicit BookView(std::size_t orderSlots = 1 << 16)
+      : levels_{}, slots_(std::bit_ceil(std::max<std::size_t>(orderSlots, 1))),
+        current_{} {}
+
+  BookView(const BookView &) = delete;
+  BookView &operator=(const BookView &) = delete;
+
+  // makes the view follow book from now on, through the book's order hook,
+  // which this takes over. call it on the matching thread, or before the
+  // matching thread starts. the view must outlive the hook
+  void attach(Book &book) {
+    book.set_order_hook([this, &book](std::span<const OrderState> changed) {
+      publish(book, changed);
+    });
+    publish(book, {});
+  }
+
+  // matching thread: stores the changed orders, then the book's top levels
+  // unless every change was below them. the two are separate records, so a
+  // reader can see an order's new state a moment before the levels it
+  // changed
+  void publish(const Book &book, std::span<const OrderState> changed) {
+    bool top = current_.version == 0;
+    for (const OrderState &state : changed)
+      top |= publishOrder(state);
+    if (!top)
+      return;
+    ++current_.version;
+    current_.bidCount = book.depth(Side::BUY, current_.bids);
+    current_.askCount = book.depth(Side::SELL, current_.asks);
+    levels_.store(current_);
+  }
+
+  // reader side, any thread
+  Levels levels() const { return levels_.load(); }
+  bool try_levels(Levels &out) const { return levels_.try_load(out); }
+
+  // best bid and ask, price 0 and no quantity on an empty side as in the
+  // book's own top_of_book()
+  TopOfBook top_of_book() const {
+    Levels levels = levels_.load();
+    TopOfBook top{};
+    if (levels.bidCount != 0)
+      top.bid = levels.bids[0];
+    if (levels.askCount != 0)
+      top.ask = levels.asks[0];
+    return top;
+  }
+
+  // the last state published for id, or nothing if the view never saw the
+  // order or has given its slot to a newer one
+  std::optional<OrderState> order(OrderId id) const {
+    OrderState state = slot(id).load();
+    if (state.id != id || id == 0)
+      return std::nullopt;
+    return state;
+  }
+
+  bool try_order(OrderId id, std::optional<OrderState> &out) const {
+    OrderState state;
+    if (!slot(id).try_load(state))
+      return false;
+    out = state.id == id && id != 0 ? std::optional{state} : std::nullopt;
+    return true;
+  }
+
+private:
+  // each slot on its own cache line, so readers polling one order do not
+  // contend with the writer publishing its neighbours
+  struct alignas(64) Slot {
+    Seqlock<OrderState> state;
+  };
+
+  Seqlock<OrderState> &slot(OrderId id) {
+    return slots_[id & (slots_.size() - 1)].state;
+  }
+  const Seqlock<OrderState> &slot(OrderId id) const {
+    return slots_[id & (slots_.size() - 1)].state;
+  }
+
+  // the book forgets a DONE order, so its side, price and size are kept from
+  // what the view last had. a state older than the slot's order is dropped.
+  // returns whether the change can have reached the published levels: it
+  // rests, or rested, at a price within them
+  bool publishOrder(OrderState state) {
+    Seqlock<OrderState> &target = slot(state.id);
+    OrderState previous = target.load();
+    if (previous.id > state.id)
+      return true;
+    bool known = previous.id == state.id;
+    if (state.status == OrderStatus::DONE && known) {
+      state.side = previous.side;
+      state.price = previous.price;
+      state.initialQty = previous.initialQty;
+    }
+    target.store(state);
+    // an order the view never saw is new, or was given up with its slot. a
+    // DONE one left no trace of where it rested, so it may have been on top
+    if (!known)
+      return state.status == OrderStatus::RESTING
+                 ? withinTop(state.side, state.price)
+                 : state.status == OrderStatus::DONE;
+    return (state.status == OrderStatus::RESTING &&
+            withinTop(state.side, state.price)) ||
+           (previous.status == OrderStatus::RESTING &&
+            withinTop(previous.side, previous.price));
+  }
+
+  // whether a level at price is one of the published ones or would become
+  // one. past the last of a full side, nothing shows
+  bool withinTop(Side side, typename Book::Price price) const {
+    if (side == Side::BUY)
+      return current_.bidCount < Depth ||
+             price >= current_.bids[Depth - 1].price;
+    return current_.askCount < Depth ||
+           price <= current_.asks[Depth - 1].price;
+  }
+
+  Seqlock<Levels> levels_;
+  std::vector<Slot> slots_;
+  // the writer's copy of the published levels
+  Levels current_;
+};
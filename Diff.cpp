@@ -0,0 +1,506 @@
+// differential test of the book implementations: one command stream, seeded
+// or read back from a journal, is applied to every book in lockstep. after
+// each command all books must report the same trades (or all reject it), and
+// every -e commands their levels must match. exits 1 at the first divergence
+// with the command that caused it and what each book did. a few fixed cases
+// the lockstep run cannot catch are checked first. the first book
+// also feeds a BookView, whose top levels and whose state for the orders a
+// command named or created must match the book's own after every command.
+// build with:
+//
+//   g++ -std=c++20 -O2 Diff.cpp -o diff
+//   ./diff [-s seed] [-n commands] [-e every] [-x] [-w out.journal]
+//   ./diff [-e every] orders.journal
+//
+// the reference (OrderBook.cpp) only knows LIMIT, MARKET and CANCEL. -x also
+// generates the other command types and leaves the reference out, as does a
+// journal that holds any of them. journals are the compact stream format:
+// fixed-size binary records, mapped and read in place, and -w writes the
+// generated stream as one so a divergence can be replayed
+
+#include "BookView.cpp"
+#include "Journal.cpp"
+
+namespace reference {
+#include "OrderBook.cpp"
+}
+
+#include <cstdio>
+#include <limits>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+struct Fill {
+  uint64_t buyId;
+  uint64_t buyPrice;
+  uint64_t sellId;
+  uint64_t sellPrice;
+  uint64_t qty;
+
+  bool operator==(const Fill &) const = default;
+};
+
+struct Result {
+  bool rejected;
+  uint64_t id; // assigned or changed id, 0 from the reference
+  std::vector<Fill> fills;
+};
+
+struct LevelState {
+  Side side;
+  uint64_t price;
+  uint64_t qty;
+  uint64_t orders;
+
+  bool operator==(const LevelState &) const = default;
+};
+
+// levels compared per side; deeper ones are left out of the state check
+static const std::size_t maxLevels = 4096;
+
+template <typename T> Fill toFill(T trade) {
+  auto buy = trade.getBuy();
+  auto sell = trade.getSell();
+  return {buy.id_, buy.price_, sell.id_, sell.price_, buy.qty_};
+}
+
+class Runner {
+public:
+  virtual ~Runner() = default;
+  virtual const char *name() const = 0;
+  virtual void apply(const Command &command, Result &result) = 0;
+  virtual std::vector<LevelState> state() = 0;
+  // the reference hands out no ids, so those are compared between the
+  // optimized books only
+  virtual bool assignsIds() const { return true; }
+  // whether a view the book feeds shows what the book holds, after command
+  // gave result. prints where it does not
+  virtual bool viewAgrees(const Command &, const Result &) { return true; }
+};
+
+template <typename Policy> class OptimizedRunner : public Runner {
+public:
+  using Book = BasicOrderBook<Policy>;
+
+  explicit OptimizedRunner(const char *name, bool watched = false)
+      : name_{name}, book_{} {
+    if (watched) {
+      view_ = std::make_unique<BookView<Book, viewDepth>>();
+      view_->attach(book_);
+    }
+  }
+
+  const char *name() const override { return name_; }
+
+  void apply(const Command &command, Result &result) override {
+    using BookCommand = typename BasicOrderBook<Policy>::Command;
+    using BookPrice = typename Policy::Price;
+    using BookQty = typename Policy::Qty;
+    BookCommand converted{command.type,
+                          command.side,
+                          static_cast<BookPrice>(command.price),
+                          static_cast<BookQty>(command.qty),
+                          command.id,
+                          command.owner,
+                          static_cast<BookPrice>(command.stopPrice)};
+    try {
+      result.id = book_.execute(converted, [&](const auto &trade) {
+        result.fills.push_back(toFill(trade));
+      });
+    } catch (const std::exception &) {
+      result.rejected = true;
+    }
+  }
+
+  std::vector<LevelState> state() override {
+    auto depth = book_.depth(maxLevels);
+    std::vector<LevelState> levels;
+    for (auto &level : depth.bids)
+      levels.push_back({Side::BUY, level.price, level.qty, level.orders});
+    for (auto &level : depth.asks)
+      levels.push_back({Side::SELL, level.price, level.qty, level.orders});
+    return levels;
+  }
+
+  bool viewAgrees(const Command &command, const Result &result) override {
+    if (!view_)
+      return true;
+    bool agrees = sameOrder(command.id) && sameOrder(result.id);
+    auto levels = view_->levels();
+    typename Book::DepthLevel bids[viewDepth], asks[viewDepth];
+    auto sameLevels = [](auto *published, uint32_t count, auto *held,
+                         std::size_t heldCount) {
+      if (count != heldCount)
+        return false;
+      for (std::size_t i = 0; i < count; ++i)
+        if (published[i].price != held[i].price ||
+            published[i].qty != held[i].qty ||
+            published[i].orders != held[i].orders)
+          return false;
+      return true;
+    };
+    if (!sameLevels(levels.bids, levels.bidCount, bids,
+                    book_.depth(Side::BUY, bids)) ||
+        !sameLevels(levels.asks, levels.askCount, asks,
+                    book_.depth(Side::SELL, asks))) {
+      std::printf("  view levels of %s are stale\n", name_);
+      agrees = false;
+    }
+    return agrees;
+  }
+
+private:
+  static const std::size_t viewDepth = 10;
+
+  // an order the view has no state for counts as DONE. a DONE order keeps
+  // the side and price the view last had, so only its status is compared
+  bool sameOrder(OrderId id) {
+    if (id == 0)
+      return true;
+    auto held = book_.order_state(id);
+    auto shown = view_->order(id);
+    auto status = shown ? shown->status : OrderStatus::DONE;
+    if (status == held.status &&
+        (status == OrderStatus::DONE ||
+         (shown->side == held.side && shown->price == held.price &&
+          shown->remainingQty == held.remainingQty)))
+      return true;
+    static const char *names[] = {"RESTING", "PENDING_STOP", "DONE"};
+    std::printf("  view of %s shows order %lu %s, the book %s\n", name_, id,
+                names[static_cast<std::size_t>(status)],
+                names[static_cast<std::size_t>(held.status)]);
+    return false;
+  }
+
+  const char *name_;
+  Book book_;
+  std::unique_ptr<BookView<Book, viewDepth>> view_;
+};
+
+class ReferenceRunner : public Runner {
+public:
+  const char *name() const override { return "reference"; }
+  bool assignsIds() const override { return false; }
+
+  void apply(const Command &command, Result &result) override {
+    reference::Side side = command.side == Side::BUY ? reference::Side::BUY
+                                                     : reference::Side::SELL;
+    try {
+      reference::Trades trades;
+      switch (command.type) {
+      case CommandType::LIMIT:
+        trades = book_.add_limit(side, command.price, command.qty);
+        break;
+      case CommandType::MARKET:
+        trades = book_.add_market(side, command.qty);
+        break;
+      case CommandType::CANCEL:
+        book_.cancel(command.id);
+        break;
+      default:
+        throw std::invalid_argument("not a reference command");
+      }
+      for (auto &trade : trades)
+        result.fills.push_back(toFill(trade));
+    } catch (const std::exception &) {
+      result.rejected = true;
+    }
+  }
+
+  std::vector<LevelState> state() override {
+    std::vector<LevelState> levels;
+    std::size_t bids = 0, asks = 0;
+    book_.for_each_level([&](reference::Side side, reference::Price price,
+                             reference::Qty qty, std::size_t orders) {
+      bool buy = side == reference::Side::BUY;
+      if ((buy ? bids++ : asks++) < maxLevels)
+        levels.push_back({buy ? Side::BUY : Side::SELL, price, qty, orders});
+    });
+    return levels;
+  }
+
+private:
+  reference::OrderBook book_;
+};
+
+// seeded command stream around a fixed mid, crossing often enough to trade.
+// ids to cancel, modify and replace are drawn from the most recent limits,
+// so some have already traded away and every book has to reject them alike.
+// a few are 0, an id no book hands out
+class Generator {
+public:
+  Generator(uint32_t seed, bool extended)
+      : rng_{seed}, extended_{extended} {}
+
+  Command next() {
+    Command command{};
+    uint32_t roll = rng_() % 100;
+    command.side = rng_() % 2 ? Side::BUY : Side::SELL;
+    command.price = price(command.side);
+    command.qty = 1 + rng_() % 50;
+    if (!extended_) {
+      command.type = roll < 55   ? CommandType::LIMIT
+                     : roll < 70 ? CommandType::MARKET
+                                 : CommandType::CANCEL;
+    } else {
+      command.type = roll < 40   ? CommandType::LIMIT
+                     : roll < 48 ? CommandType::MARKET
+                     : roll < 66 ? CommandType::CANCEL
+                     : roll < 76 ? CommandType::MODIFY
+                     : roll < 86 ? CommandType::REPLACE
+                     : roll < 88 ? CommandType::IOC
+                     : roll < 92 ? CommandType::FOK
+                     : roll < 95 ? CommandType::STOP
+                     : roll < 98 ? CommandType::STOP_LIMIT
+                                 : CommandType::CANCEL_OWNER;
+      command.owner = 1 + rng_() % 8;
+      command.stopPrice = price(rng_() % 2 ? Side::BUY : Side::SELL);
+    }
+    if (command.type == CommandType::MARKET)
+      command.qty = rng_() % 120;
+    if (command.type == CommandType::MODIFY)
+      command.qty = rng_() % 60;
+    if (command.type == CommandType::CANCEL ||
+        command.type == CommandType::MODIFY ||
+        command.type == CommandType::REPLACE)
+      // now and then id 0, which no book hands out, so every one rejects it
+      command.id = recent_.empty() || rng_() % 64 == 0
+                       ? 0
+                       : recent_[rng_() % recent_.size()];
+    return command;
+  }
+
+  // learns the id a limit or a stop limit was given, from the first book's
+  // result
+  void observe(const Command &command, const Result &result) {
+    if ((command.type != CommandType::LIMIT &&
+         command.type != CommandType::STOP_LIMIT) ||
+        result.rejected)
+      return;
+    if (recent_.size() < recentIds)
+      recent_.push_back(result.id);
+    else
+      recent_[next_++ % recentIds] = result.id;
+  }
+
+private:
+  static const std::size_t recentIds = 1024;
+  static const Price mid = 1 << 15;
+
+  Price price(Side side) {
+    Price offset = rng_() % 64;
+    return side == Side::BUY ? mid - 40 + offset : mid - 24 + offset;
+  }
+
+  std::mt19937 rng_;
+  bool extended_;
+  std::vector<OrderId> recent_;
+  std::size_t next_ = 0;
+};
+
+// stands in for a book so replayJournal hands over the records it reads
+struct Recorder {
+  using Command = ::Command;
+
+  template <typename Sink> OrderId execute(const Command &command, Sink &&) {
+    commands.push_back(command);
+    return 0;
+  }
+
+  std::vector<Command> commands;
+};
+
+static bool referenceCommand(const Command &command) {
+  return command.type == CommandType::LIMIT ||
+         command.type == CommandType::MARKET ||
+         command.type == CommandType::CANCEL;
+}
+
+static const char *typeName(CommandType type) {
+  static const char *names[] = {"LIMIT",   "MARKET",       "CANCEL",
+                                "MODIFY",  "REPLACE",      "CANCEL_OWNER",
+                                "IOC",     "FOK",          "STOP",
+                                "STOP_LIMIT"};
+  return names[static_cast<std::size_t>(type)];
+}
+
+static void printCommand(std::size_t index, const Command &command) {
+  std::printf("command %zu: %s %c price %u qty %u id %lu owner %u stop %u\n",
+              index, typeName(command.type),
+              command.side == Side::BUY ? 'B' : 'S', command.price,
+              command.qty, command.id, command.owner, command.stopPrice);
+}
+
+static void printResult(const char *name, const Result &result) {
+  std::printf("  %-10s %s id %lu, %zu trades\n", name,
+              result.rejected ? "rejected" : "accepted", result.id,
+              result.fills.size());
+  for (const Fill &fill : result.fills)
+    std::printf("    buy %lu @ %lu, sell %lu @ %lu, qty %lu\n", fill.buyId,
+                fill.buyPrice, fill.sellId, fill.sellPrice, fill.qty);
+}
+
+static void printLevels(const char *name,
+                        const std::vector<LevelState> &levels,
+                        std::size_t from) {
+  std::printf("  %-10s %zu levels\n", name, levels.size());
+  for (std::size_t i = from; i < levels.size() && i < from + 4; ++i)
+    std::printf("    %c %lu: qty %lu in %lu orders\n",
+                levels[i].side == Side::BUY ? 'B' : 'S', levels[i].price,
+                levels[i].qty, levels[i].orders);
+}
+
+// fixed cases the lockstep run cannot catch, as every book that takes part
+// in it runs the same code for them. each prints what went wrong and
+// returns false
+
+// a stop fires on any trade of a call at or through its trigger, not only
+// on the call's last one: a sell stop at 101 must fire when a buy takes the
+// asks at 100 and 105, although the last trade is at 105
+template <typename Policy> bool stopsSeeEveryTrade(const char *name) {
+  using Book = BasicOrderBook<Policy>;
+  const typename Policy::Price base = 1 << 15;
+  Book book;
+  auto ignore = [](const typename Book::Trade &) {};
+  book.add_limit(Side::SELL, base + 10, 1, ignore);
+  book.add_market(Side::BUY, 1, ignore);
+  OrderId stop = book.add_stop(Side::SELL, base + 1, 1, ignore);
+  book.add_limit(Side::SELL, base, 1, ignore);
+  book.add_limit(Side::SELL, base + 5, 1, ignore);
+  book.add_market(Side::BUY, 2, ignore);
+  if (book.order_state(stop).status == OrderStatus::DONE)
+    return true;
+  std::printf("%s: a sell stop stayed pending after a trade below its "
+              "trigger\n",
+              name);
+  return false;
+}
+
+static bool sameResult(const Result &a, const Result &b, bool compareIds) {
+  return a.rejected == b.rejected && a.fills == b.fills &&
+         (!compareIds || a.rejected || a.id == b.id);
+}
+
+int main(int argc, char **argv) {
+  uint32_t seed = 1;
+  std::size_t count = 1000000;
+  std::size_t every = 1000;
+  bool extended = false;
+  std::string out;
+  int opt;
+  while ((opt = ::getopt(argc, argv, "s:n:e:xw:")) != -1) {
+    switch (opt) {
+    case 's':
+      seed = std::stoul(optarg);
+      break;
+    case 'n':
+      count = std::stoull(optarg);
+      break;
+    case 'e':
+      every = std::max<std::size_t>(1, std::stoull(optarg));
+      break;
+    case 'x':
+      extended = true;
+      break;
+    case 'w':
+      out = optarg;
+      break;
+    default:
+      std::fprintf(stderr,
+                   "usage: %s [-s seed] [-n commands] [-e every] [-x] "
+                   "[-w out.journal] [journal]\n",
+                   argv[0]);
+      return 2;
+    }
+  }
+
+  Recorder recorded;
+  bool fromJournal = optind < argc;
+  bool narrowPrices = true;
+  if (fromJournal) {
+    replayJournal(argv[optind], recorded, [](const Trade &) {});
+    count = recorded.commands.size();
+    for (const Command &command : recorded.commands) {
+      extended = extended || !referenceCommand(command);
+      narrowPrices =
+          narrowPrices &&
+          command.price <= std::numeric_limits<uint16_t>::max() &&
+          command.stopPrice <= std::numeric_limits<uint16_t>::max();
+    }
+  }
+
+  std::vector<std::unique_ptr<Runner>> runners;
+  runners.push_back(
+      std::make_unique<OptimizedRunner<DefaultPolicy>>("default", true));
+  runners.push_back(std::make_unique<OptimizedRunner<SplitPolicy>>("split"));
+  runners.push_back(std::make_unique<OptimizedRunner<WidePolicy>>("wide"));
+  if (narrowPrices)
+    runners.push_back(
+        std::make_unique<OptimizedRunner<CompactPolicy>>("compact"));
+  if (!extended)
+    runners.push_back(std::make_unique<ReferenceRunner>());
+
+  if (!stopsSeeEveryTrade<DefaultPolicy>("default") ||
+      !stopsSeeEveryTrade<SplitPolicy>("split") ||
+      !stopsSeeEveryTrade<WidePolicy>("wide") ||
+      !stopsSeeEveryTrade<CompactPolicy>("compact"))
+    return 1;
+
+  std::unique_ptr<Journal<OrderBook>> journal;
+  if (!out.empty())
+    journal = std::make_unique<Journal<OrderBook>>(out, false);
+
+  Generator generator(seed, extended);
+  std::vector<Result> results(runners.size());
+  uint64_t trades = 0;
+  for (std::size_t i = 0; i < count; ++i) {
+    Command command = fromJournal ? recorded.commands[i] : generator.next();
+    if (journal)
+      journal->append(command);
+    for (std::size_t r = 0; r < runners.size(); ++r) {
+      results[r].rejected = false;
+      results[r].id = 0;
+      results[r].fills.clear();
+      runners[r]->apply(command, results[r]);
+    }
+    for (std::size_t r = 1; r < runners.size(); ++r) {
+      if (sameResult(results[0], results[r], runners[r]->assignsIds()))
+        continue;
+      printCommand(i, command);
+      for (std::size_t k = 0; k < runners.size(); ++k)
+        printResult(runners[k]->name(), results[k]);
+      return 1;
+    }
+    if (!runners[0]->viewAgrees(command, results[0])) {
+      printCommand(i, command);
+      return 1;
+    }
+    trades += results[0].fills.size();
+    if (!fromJournal)
+      generator.observe(command, results[0]);
+
+    if ((i + 1) % every != 0 && i + 1 != count)
+      continue;
+    auto expected = runners[0]->state();
+    for (std::size_t r = 1; r < runners.size(); ++r) {
+      auto levels = runners[r]->state();
+      if (levels == expected)
+        continue;
+      std::size_t from = 0;
+      while (from < levels.size() && from < expected.size() &&
+             levels[from] == expected[from])
+        ++from;
+      std::printf("book state differs after command %zu\n", i);
+      printLevels(runners[0]->name(), expected, from);
+      printLevels(runners[r]->name(), levels, from);
+      return 1;
+    }
+  }
+
+  std::printf("%zu commands, %lu trades: %zu books agree\n", count, trades,
+              runners.size());
+}
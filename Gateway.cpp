@@ -0,0 +1,251 @@
+#pragma once
+
+// coroutine front end for the matching engine. one gateway thread runs any
+// number of sessions as coroutines: each reads order messages from a
+// non-blocking fd (a socket, a pipe or a shared-memory eventfd channel),
+// decodes them into commands and co_awaits their execution. a command is
+// executed by submitting it to a Sequencer, so the matching thread applies
+// it like any other, and its coroutine resumes on the gateway thread once
+// the command's last event is back. while one session waits on the book
+// the others read and decode, which overlaps I/O with matching.
+//
+// the gateway is the sequencer's only producer and the only consumer of its
+// results, and everything here runs on the gateway thread. the synchronous
+// add_limit / add_market / cancel API of the book is untouched
+
+#include "Sequencer.cpp"
+
+#include <cerrno>
+#include <coroutine>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <limits>
+#include <vector>
+
+#include <poll.h>
+#include <unistd.h>
+
+// return type of a session coroutine: it starts at once and frees its own
+// frame when it finishes
+struct GatewayTask {
+  struct promise_type {
+    GatewayTask get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+template <typename Book = OrderBook> class Gateway {
+public:
+  using Command = typename Book::Command;
+  using Event = BasicEvent<Book>;
+  using OrderId = typename Book::OrderId;
+  using TradeHandler = std::function<void(const Event &)>;
+
+  // seq of an Ack for a command refused before it reached the sequencer
+  static constexpr uint64_t unsequenced = std::numeric_limits<uint64_t>::max();
+
+  // what a command came to: ACCEPTED, CANCELLED or REJECTED, the id the book
+  // gave or changed, and how many TRADE events it produced
+  struct Ack {
+    EventType type;
+    uint64_t seq;
+    OrderId id;
+    std::size_t trades;
+  };
+
+  // awaitable for one command, resuming with its Ack
+  class Execution {
+  public:
+    Execution(Gateway &gateway, const Command &command)
+        : gateway_{gateway}, command_{command}, handle_{}, ack_{} {}
+
+    bool await_ready() const { return false; }
+    void await_suspend(std::coroutine_handle<> handle) {
+      handle_ = handle;
+      gateway_.submit(this);
+    }
+    Ack await_resume() const { return ack_; }
+
+  private:
+    friend class Gateway;
+
+    Gateway &gateway_;
+    Command command_;
+    std::coroutine_handle<> handle_;
+    Ack ack_;
+  };
+
+  // awaitable for one read(), resuming with what it returned
+  class Read {
+  public:
+    Read(Gateway &gateway, int fd, void *data, std::size_t size)
+        : gateway_{gateway}, fd_{fd}, data_{data}, size_{size}, handle_{},
+          result_{-1} {}
+
+    // a read that need not wait completes without suspending
+    bool await_ready() { return attempt(); }
+    void await_suspend(std::coroutine_handle<> handle) {
+      handle_ = handle;
+      gateway_.readers_.push_back(this);
+    }
+    ssize_t await_resume() const { return result_; }
+
+  private:
+    friend class Gateway;
+
+    bool attempt() {
+      result_ = ::read(fd_, data_, size_);
+      return result_ >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+    }
+
+    Gateway &gateway_;
+    int fd_;
+    void *data_;
+    std::size_t size_;
+    std::coroutine_handle<> handle_;
+    ssize_t result_;
+  };
+
+  // trades go to onTrade as they come back, ahead of their command's Ack
+  Gateway(Sequencer<Book> &sequencer, std::size_t producer,
+          TradeHandler onTrade = {})
+      : sequencer_{sequencer}, producer_{producer},
+        onTrade_{std::move(onTrade)}, backlog_{}, readers_{}, ready_{},
+        fds_{} {}
+
+  Gateway(const Gateway &) = delete;
+  Gateway &operator=(const Gateway &) = delete;
+
+  // submits command and suspends until the matching thread has applied it
+  Execution execute(const Command &command) {
+    return Execution{*this, command};
+  }
+
+  // reads up to size bytes from the non-blocking fd, suspending until it is
+  // readable. yields what read() did: the bytes read, 0 at the end of the
+  // stream or -1 on an error
+  Read read(int fd, void *data, std::size_t size) {
+    return Read{*this, fd, data, size};
+  }
+
+  // commands submitted whose results are not all back yet
+  std::size_t inFlight() const { return inFlight_; }
+
+  // one turn of the gateway loop: takes in results and resumes the
+  // coroutines whose commands completed, resubmits what the ingress ring had
+  // no room for, then resumes the readers whose fds became readable. returns
+  // how much it did, so an idle loop can back off
+  std::size_t poll() {
+    std::size_t done = 0;
+    // results first: the matching thread may be waiting for room to publish
+    Event event;
+    while (sequencer_.poll(event)) {
+      ++done;
+      auto *execution = reinterpret_cast<Execution *>(event.tag);
+      if (event.type == EventType::TRADE) {
+        ++execution->ack_.trades;
+        if (onTrade_)
+          onTrade_(event);
+      } else {
+        execution->ack_.type = event.type;
+        execution->ack_.seq = event.seq;
+        execution->ack_.id = event.id;
+      }
+      if (event.last) {
+        --inFlight_;
+        execution->handle_.resume();
+      }
+    }
+    while (!backlog_.empty() && push(backlog_.front())) {
+      backlog_.pop_front();
+      ++done;
+    }
+    return done + pollReaders();
+  }
+
+private:
+  void submit(Execution *execution) {
+    ++inFlight_;
+    // behind a backlog a command waits its turn, to keep submission order
+    if (!backlog_.empty() || !push(execution))
+      backlog_.push_back(execution);
+  }
+
+  bool push(Execution *execution) {
+    return sequencer_.submit(producer_, execution->command_,
+                             reinterpret_cast<uintptr_t>(execution));
+  }
+
+  std::size_t pollReaders() {
+    if (readers_.empty())
+      return 0;
+    fds_.resize(readers_.size());
+    for (std::size_t i = 0; i < readers_.size(); ++i)
+      fds_[i] = pollfd{readers_[i]->fd_, POLLIN, 0};
+    if (::poll(fds_.data(), fds_.size(), 0) <= 0)
+      return 0;
+    // readers leave the wait list before any resumes, as a resumed session
+    // may start waiting again
+    ready_.clear();
+    std::size_t kept = 0;
+    for (std::size_t i = 0; i < readers_.size(); ++i) {
+      if (fds_[i].revents != 0 && readers_[i]->attempt())
+        ready_.push_back(readers_[i]);
+      else
+        readers_[kept++] = readers_[i];
+    }
+    readers_.resize(kept);
+    for (Read *reader : ready_)
+      reader->handle_.resume();
+    return ready_.size();
+  }
+
+  Sequencer<Book> &sequencer_;
+  std::size_t producer_;
+  TradeHandler onTrade_;
+  std::deque<Execution *> backlog_;
+  std::vector<Read *> readers_;
+  std::vector<Read *> ready_;
+  std::vector<pollfd> fds_;
+  std::size_t inFlight_ = 0;
+};
+
+// a session over one connection whose messages are raw Command records, the
+// layout journals use. each record is decoded straight out of the read
+// buffer and executed in turn, and onAck(command, ack) sees every result.
+// a record with an unknown type or side is REJECTED without being
+// sequenced. the session ends at the end of the stream or on a read error
+template <typename Book, typename OnAck>
+GatewayTask serveCommands(Gateway<Book> &gateway, int fd, OnAck onAck) {
+  using Command = typename Book::Command;
+  std::vector<char> buffer(64 * sizeof(Command));
+  std::size_t filled = 0;
+  for (;;) {
+    ssize_t n = co_await gateway.read(fd, buffer.data() + filled,
+                                      buffer.size() - filled);
+    if (n <= 0)
+      co_return;
+    filled += n;
+    std::size_t used = 0;
+    for (; filled - used >= sizeof(Command); used += sizeof(Command)) {
+      Command command;
+      std::memcpy(&command, buffer.data() + used, sizeof(Command));
+      if (!knownCommand(static_cast<uint32_t>(command.type),
+                        static_cast<uint32_t>(command.side))) {
+        onAck(command, typename Gateway<Book>::Ack{
+                           EventType::REJECTED, Gateway<Book>::unsequenced,
+                           0, 0});
+        continue;
+      }
+      onAck(command, co_await gateway.execute(command));
+    }
+    std::memmove(buffer.data(), buffer.data() + used, filled - used);
+    filled -= used;
+  }
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+// huge-page backing for the book's large arrays: the order pool, the id
+// index and the price ladders. a policy opts in by naming HugePageAllocator
+// as its Allocator; the default stays on std::allocator.
+//
+// big blocks are mapped from 1GB or 2MB pages and faulted in when they are
+// allocated, so the matching path takes neither the page faults of first
+// touch nor, on most accesses, a TLB miss. the pages are placed on the NUMA
+// node of the thread that allocates them, so the book should be built on
+// the matching thread (or one pinned to its node)
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <system_error>
+
+#include <cerrno>
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+inline constexpr std::size_t hugePageSize = std::size_t{2} << 20;
+inline constexpr std::size_t gigaPageSize = std::size_t{1} << 30;
+
+// the length a block of size bytes is mapped with. it only depends on size,
+// so a block is unmapped with the same length whichever page size it got
+inline std::size_t hugeMappingLength(std::size_t size) {
+  std::size_t page = size >= gigaPageSize ? gigaPageSize : hugePageSize;
+  return (size + page - 1) / page * page;
+}
+
+// maps length bytes of ordinary pages, aligned to a huge page so that
+// transparent huge pages can back all of it, and asks for them
+inline void *mapAlignedPages(std::size_t length) {
+  void *mapped = ::mmap(nullptr, length + hugePageSize, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapped == MAP_FAILED)
+    throw std::bad_alloc();
+  auto start = reinterpret_cast<uintptr_t>(mapped);
+  uintptr_t aligned = (start + hugePageSize - 1) & ~(hugePageSize - 1);
+  if (aligned != start)
+    ::munmap(mapped, aligned - start);
+  std::size_t tail = start + hugePageSize - aligned;
+  if (tail != 0)
+    ::munmap(reinterpret_cast<void *>(aligned + length), tail);
+  void *block = reinterpret_cast<void *>(aligned);
+  ::madvise(block, length, MADV_HUGEPAGE);
+  return block;
+}
+
+// maps length bytes (from hugeMappingLength) on the largest page size the
+// system has reserved, falling back to ordinary pages with transparent huge
+// pages requested. every page is faulted in before this returns, and with
+// lock set the block is pinned as well
+inline void *mapHugePages(std::size_t length, bool lock) {
+  const int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+  void *block = MAP_FAILED;
+  if (length % gigaPageSize == 0)
+    block = ::mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                   flags | (30 << MAP_HUGE_SHIFT), -1, 0);
+  if (block == MAP_FAILED)
+    block = ::mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                   flags | (21 << MAP_HUGE_SHIFT), -1, 0);
+  if (block == MAP_FAILED)
+    block = mapAlignedPages(length);
+  // keep the pages local even under an interleaving default policy. nothing
+  // is faulted in yet, so this places every page. a kernel without NUMA
+  // support refuses it, which changes nothing
+  ::syscall(SYS_mbind, block, length, MPOL_LOCAL, nullptr, 0, 0);
+  // fault the block in, one write per small page
+  volatile char *bytes = static_cast<char *>(block);
+  for (std::size_t offset = 0; offset < length; offset += 4096)
+    bytes[offset] = 0;
+  if (lock && ::mlock(block, length) != 0) {
+    int error = errno;
+    ::munmap(block, length);
+    throw std::system_error(error, std::generic_category(),
+                            "cannot lock book memory");
+  }
+  return block;
+}
+
+// allocator for the policy hooks. blocks of at least half a huge page get
+// their own mapping; smaller ones would mostly waste it and come from the
+// heap. with Lock every mapped block is also mlock()ed
+template <typename T, bool Lock = false> class HugePageAllocator {
+public:
+  using value_type = T;
+
+  template <typename U> struct rebind {
+    using other = HugePageAllocator<U, Lock>;
+  };
+
+  HugePageAllocator() = default;
+  template <typename U>
+  HugePageAllocator(const HugePageAllocator<U, Lock> &) {}
+
+  T *allocate(std::size_t n) {
+    std::size_t size = n * sizeof(T);
+    if (size < hugePageSize / 2)
+      return static_cast<T *>(
+          ::operator new(size, std::align_val_t{alignof(T)}));
+    return static_cast<T *>(mapHugePages(hugeMappingLength(size), Lock));
+  }
+
+  void deallocate(T *block, std::size_t n) {
+    std::size_t size = n * sizeof(T);
+    if (size < hugePageSize / 2)
+      ::operator delete(block, std::align_val_t{alignof(T)});
+    else
+      ::munmap(block, hugeMappingLength(size));
+  }
+
+  template <typename U>
+  bool operator==(const HugePageAllocator<U, Lock> &) const {
+    return true;
+  }
+};
+
+// how many bytes a pool should ask its allocator for at once, so that one
+// backed by huge pages is handed whole pages
+template <typename Allocator>
+inline constexpr std::size_t allocationGranule = 1;
+
+template <typename T, bool Lock>
+inline constexpr std::size_t
+    allocationGranule<HugePageAllocator<T, Lock>> = hugePageSize;
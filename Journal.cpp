@@ -0,0 +1,232 @@
+#pragma once
+
+#include "Sequencer.cpp"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// a journal file is a JournalHeader followed by fixed-size records, each the
+// bytes of one Book::Command, padding zeroed, in the order it was applied.
+// recordSize guards against replaying a journal written by a book of another
+// policy
+struct JournalHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t recordSize;
+};
+
+inline constexpr char journalMagic[8] = {'O', 'B', 'J', 'O',
+                                         'U', 'R', 'N', 'L'};
+inline constexpr uint32_t journalVersion = 2;
+
+inline std::system_error journalError(const std::string &what) {
+  return std::system_error(errno, std::generic_category(), what);
+}
+
+inline bool validJournalHeader(const JournalHeader &header,
+                               uint32_t recordSize) {
+  return std::memcmp(header.magic, journalMagic, sizeof(journalMagic)) == 0 &&
+         header.version == journalVersion && header.recordSize == recordSize;
+}
+
+// append-only command log. the matching thread calls append() with each
+// command right before it applies it; append only copies the record into a
+// ring, and a writer thread drains the ring in batches with one write() (and,
+// if sync is set, one fdatasync()) per batch, so the disk never sits on the
+// matching path. a record is durable once its batch is written
+template <typename Book = OrderBook> class Journal {
+public:
+  using Command = typename Book::Command;
+  static_assert(std::is_trivially_copyable_v<Command>);
+
+  // opens or creates path. an existing journal is appended to, after any
+  // partial record a crash left at its end is cut off
+  explicit Journal(const std::string &path, bool sync = true,
+                   std::size_t ringCapacity = defaultRingCapacity)
+      : ring_{ringCapacity}, batch_{}, fd_{-1}, sync_{sync} {
+    fd_ = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd_ < 0)
+      throw journalError("cannot open journal " + path);
+    try {
+      prepare();
+    } catch (...) {
+      ::close(fd_);
+      throw;
+    }
+    batch_.reserve(maxBatch);
+    running_.store(true, std::memory_order_release);
+    writer_ = std::thread([this] { run(); });
+  }
+
+  Journal(const Journal &) = delete;
+  Journal &operator=(const Journal &) = delete;
+
+  ~Journal() {
+    stop();
+    ::close(fd_);
+  }
+
+  // single producer: only the matching thread may call this. waits for the
+  // writer rather than drop a record if the ring is full
+  void append(const Command &command) {
+    while (!ring_.try_push(command))
+      std::this_thread::yield();
+  }
+
+  // writes out everything appended so far and stops the writer thread
+  void stop() {
+    running_.store(false, std::memory_order_release);
+    if (writer_.joinable())
+      writer_.join();
+  }
+
+private:
+  static const std::size_t defaultRingCapacity = 1 << 16;
+  static const std::size_t maxBatch = 4096;
+  static constexpr uint32_t recordSize = sizeof(Command);
+
+  void prepare() {
+    struct stat st;
+    if (::fstat(fd_, &st) != 0)
+      throw journalError("cannot stat journal");
+    if (st.st_size == 0) {
+      JournalHeader header{};
+      std::memcpy(header.magic, journalMagic, sizeof(journalMagic));
+      header.version = journalVersion;
+      header.recordSize = recordSize;
+      writeAll(&header, sizeof(header));
+      return;
+    }
+    JournalHeader header{};
+    if (::pread(fd_, &header, sizeof(header), 0) != sizeof(header) ||
+        !validJournalHeader(header, recordSize))
+      throw std::runtime_error("not a journal for this book");
+    off_t records = (st.st_size - sizeof(header)) / recordSize;
+    off_t end = sizeof(header) + records * recordSize;
+    if (end != st.st_size && ::ftruncate(fd_, end) != 0)
+      throw journalError("cannot truncate journal");
+    if (::lseek(fd_, end, SEEK_SET) < 0)
+      throw journalError("cannot seek journal");
+  }
+
+  // an error surfaces on the writer thread and ends the process: matching
+  // on past a record that never reached the disk would make recovery
+  // silently diverge
+  void run() {
+    while (running_.load(std::memory_order_acquire)) {
+      if (writeBatch() == 0)
+        std::this_thread::yield();
+    }
+    while (writeBatch() != 0) {
+    }
+  }
+
+  std::size_t writeBatch() {
+    Command command;
+    while (batch_.size() < maxBatch && ring_.try_pop(command))
+      pack(batch_.emplace_back(), command);
+    std::size_t written = batch_.size();
+    if (written == 0)
+      return 0;
+    writeAll(batch_.data(), written * sizeof(Command));
+    if (sync_ && ::fdatasync(fd_) != 0)
+      throw journalError("cannot sync journal");
+    batch_.clear();
+    return written;
+  }
+
+  // copies command into record field by field over zeroed bytes, so the
+  // struct's padding (whatever the caller's stack held) never reaches the
+  // file and equal commands always journal as equal bytes
+  static void pack(Command &record, const Command &command) {
+    std::memset(&record, 0, sizeof(record));
+    record.type = command.type;
+    record.side = command.side;
+    record.price = command.price;
+    record.qty = command.qty;
+    record.id = command.id;
+    record.owner = command.owner;
+    record.stopPrice = command.stopPrice;
+  }
+
+  void writeAll(const void *data, std::size_t size) {
+    const char *bytes = static_cast<const char *>(data);
+    while (size > 0) {
+      ssize_t n = ::write(fd_, bytes, size);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        throw journalError("cannot write journal");
+      bytes += n;
+      size -= n;
+    }
+  }
+
+  SpscRing<Command> ring_;
+  std::vector<Command> batch_;
+  int fd_;
+  bool sync_;
+  std::atomic<bool> running_{false};
+  std::thread writer_;
+};
+
+// feeds every record of the journal at path to book.execute in order, with
+// the journal mapped read-only so records are read in place. a command the
+// book rejects was rejected when it was journaled too, so it is skipped.
+// returns the number of records replayed
+template <typename Book, typename Sink>
+std::size_t replayJournal(const std::string &path, Book &book, Sink &&sink) {
+  using Command = typename Book::Command;
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw journalError("cannot open journal " + path);
+  struct stat st;
+  if (::fstat(fd, &st) != 0) {
+    ::close(fd);
+    throw journalError("cannot stat journal");
+  }
+  std::size_t size = st.st_size;
+  if (size < sizeof(JournalHeader)) {
+    ::close(fd);
+    throw std::runtime_error("not a journal for this book");
+  }
+  void *map = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (map == MAP_FAILED)
+    throw journalError("cannot map journal");
+  ::madvise(map, size, MADV_SEQUENTIAL);
+
+  const char *bytes = static_cast<const char *>(map);
+  JournalHeader header;
+  std::memcpy(&header, bytes, sizeof(header));
+  if (!validJournalHeader(header, sizeof(Command))) {
+    ::munmap(map, size);
+    throw std::runtime_error("not a journal for this book");
+  }
+
+  // a torn record at the end is ignored
+  std::size_t count = (size - sizeof(header)) / sizeof(Command);
+  const char *records = bytes + sizeof(header);
+  for (std::size_t i = 0; i < count; ++i) {
+    Command command;
+    std::memcpy(&command, records + i * sizeof(Command), sizeof(Command));
+    try {
+      book.execute(command, sink);
+    } catch (const std::exception &) {
+    }
+  }
+  ::munmap(map, size);
+  return count;
+}
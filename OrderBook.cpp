@@ -26,7 +26,8 @@ public:
   Order(Side side, OrderId id, OrderType type, Price price, Qty qty)
       : side_{side}, id_{id}, type_{type}, price_{price}, initialQty_{qty},
         remainingQty_{qty} {
-    throw std::logic_error("cannot create order with no quantity!");
+    if (qty == 0)
+      throw std::logic_error("cannot create order with no quantity!");
   }
 
   OrderId getOrderId() { return id_; }
@@ -162,7 +163,7 @@ public:
     Trades trades;
     trades.reserve(orderIdToIterator_.size());
 
-    while (true) {
+    while (!asks_.empty() && !bids_.empty()) {
       auto &[bestAsk, asks] = *asks_.begin();
       auto &[bestBid, bids] = *bids_.begin();
       if (bestAsk > bestBid)
@@ -173,14 +174,16 @@ public:
       Qty exec = std::min(bid.getRemainingQty(), ask.getRemainingQty());
       bid.fill(exec);
       ask.fill(exec);
+      trades.emplace_back(TradeInfo{bid.getOrderId(), bid.getPrice(), exec},
+                          TradeInfo{ask.getOrderId(), ask.getPrice(), exec});
 
       if (bid.isFilled()) {
-        bids.pop_front();
         orderIdToIterator_.erase(bid.getOrderId());
+        bids.pop_front();
       }
       if (ask.isFilled()) {
+        orderIdToIterator_.erase(ask.getOrderId());
         asks.pop_front();
-        orderIdToIterator_.erase(bid.getOrderId());
       }
 
       if (asks.empty()) {
@@ -189,23 +192,41 @@ public:
       if (bids.empty()) {
         bids_.erase(bestBid);
       }
-
-      trades.emplace_back(TradeInfo{bid.getOrderId(), bid.getPrice(), exec},
-                          TradeInfo{ask.getOrderId(), ask.getPrice(), exec});
     }
     return trades;
   }
 
   void cancel(OrderId id) {
-    auto &[side, price, it] = orderIdToIterator_[id];
+    auto &[side, price, it] = orderIdToIterator_.at(id);
     if (side == Side::BUY) {
-      bids_[price].erase(it);
+      auto level = bids_.find(price);
+      level->second.erase(it);
+      if (level->second.empty())
+        bids_.erase(level);
     } else {
-      asks_[price].erase(it);
+      auto level = asks_.find(price);
+      level->second.erase(it);
+      if (level->second.empty())
+        asks_.erase(level);
     }
     orderIdToIterator_.erase(id);
   }
 
+  // calls fn(side, price, qty, orders) for every level, bids then asks, each
+  // side best price first
+  template <typename Fn> void for_each_level(Fn &&fn) {
+    auto visit = [&](Side side, auto &levels) {
+      for (auto &[price, level] : levels) {
+        Qty qty = 0;
+        for (Order &order : level)
+          qty += order.getRemainingQty();
+        fn(side, price, qty, level.size());
+      }
+    };
+    visit(Side::BUY, bids_);
+    visit(Side::SELL, asks_);
+  }
+
 private:
   std::map<Price, Level, std::less<Price>> asks_;
   std::map<Price, Level, std::greater<Price>> bids_;
@@ -1,44 +1,82 @@
+#pragma once
 
 #include <algorithm>
 #include <atomic>
+#include <bit>
 #include <cmath>
+#include <cstring>
 #include <functional>
 #include <iomanip>
 #include <iostream>
+#include <limits>
 #include <list>
 #include <map>
 #include <memory>
 #include <optional>
 #include <set>
+#include <span>
 #include <stdexcept>
 #include <tuple>
+#include <type_traits>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
-enum class Side { BUY, SELL };
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
-enum class OrderType { LIMIT, MARKET };
+#include "HugePages.cpp"
+#include "Stats.cpp"
 
-using OrderId = uint64_t;
-using Price = uint32_t;
-using Qty = uint32_t;
+// one byte each, so Order has room for an owner tag in its 40 bytes
+enum class Side : uint8_t { BUY, SELL };
 
-class Order {
+// IOC and FOK orders carry a limit but never rest: IOC trades what it can,
+// FOK trades all or nothing. STOP and STOP_LIMIT orders wait off the book
+// for a trade at their trigger, then enter as a MARKET or a LIMIT order
+enum class OrderType : uint8_t { LIMIT, MARKET, IOC, FOK, STOP, STOP_LIMIT };
+
+constexpr Side opposite(Side side) {
+  return side == Side::BUY ? Side::SELL : Side::BUY;
+}
+
+using OrderIndex = uint32_t;
+
+// who entered an order (a session or account), for mass cancels. 0 is the
+// default for orders entered without one
+using OwnerTag = uint32_t;
+
+constexpr OrderIndex nullOrder = std::numeric_limits<OrderIndex>::max();
+
+// everything below is templated on a Policy, which fixes the integer widths
+// (OrderId, Price, Qty), the container each side's levels live in, the id
+// index, the order pool and the allocator behind the large arrays. see
+// DefaultPolicy further down
+template <typename Policy> class BasicOrder {
 public:
-  Order()
+  using OrderId = typename Policy::OrderId;
+  using Price = typename Policy::Price;
+  using Qty = typename Policy::Qty;
+
+  BasicOrder()
       : side_{}, id_{}, type_{}, price_{}, initialQty_{}, remainingQty_{0} {};
-  Order(Side side, OrderId id, OrderType type, Price price, Qty qty)
+  BasicOrder(Side side, OrderId id, OrderType type, Price price, Qty qty)
       : side_{side}, id_{id}, type_{type}, price_{price}, initialQty_{qty},
         remainingQty_{qty} {
-    throw std::logic_error("cannot create order with no quantity!");
+    if (qty == 0)
+      throw std::logic_error("cannot create order with no quantity!");
   }
 
-  OrderId getOrderId() { return id_; }
-  Side getSide() { return side_; }
-  Price getPrice() { return price_; }
-  Qty getInitialQty() { return initialQty_; }
-  Qty getRemainingQty() { return remainingQty_; }
-  Qty getFilledQty() { return initialQty_ - remainingQty_; }
+  OrderId getOrderId() const { return id_; }
+  Side getSide() const { return side_; }
+  Price getPrice() const { return price_; }
+  Qty getInitialQty() const { return initialQty_; }
+  Qty getRemainingQty() const { return remainingQty_; }
+  Qty getFilledQty() const { return initialQty_ - remainingQty_; }
+  OrderIndex getPrev() const { return prev_; }
+  OrderIndex getNext() const { return next_; }
+  OwnerTag getOwner() const { return owner_; }
 
   void setOrderId(OrderId id) { id_ = id; }
   void setSide(Side side) { side_ = side; }
@@ -46,13 +84,16 @@ public:
   void setPrice(Price price) { price_ = price; }
   void setInitialQty(Qty qty) { initialQty_ = qty; }
   void setRemainingQty(Qty qty) { remainingQty_ = qty; }
+  void setPrev(OrderIndex prev) { prev_ = prev; }
+  void setNext(OrderIndex next) { next_ = next; }
+  void setOwner(OwnerTag owner) { owner_ = owner; }
 
   void fill(Qty exec) {
     if (exec > remainingQty_)
       throw std::logic_error("overfill");
     remainingQty_ -= exec;
   }
-  bool isFilled() { return remainingQty_ == 0; }
+  bool isFilled() const { return remainingQty_ == 0; }
 
 private:
   OrderId id_;
@@ -61,199 +102,2139 @@ private:
   Price price_;
   Qty initialQty_;
   Qty remainingQty_;
+  // intrusive links into the level the order rests on, or into the pool's
+  // free list while the order is unused
+  OrderIndex prev_{nullOrder};
+  OrderIndex next_{nullOrder};
+  OwnerTag owner_{0};
 };
 
-class OrderPool {
+// how much a book allocates up front. sized for the deepest book expected,
+// it keeps every allocation off the matching path
+struct BookCapacity {
+  std::size_t orders = 4096;      // orders the pool holds before it grows
+  std::size_t idWindow = 1 << 16; // id span the direct id index covers,
+                                  // at least orders
+};
+
+// slab allocator for orders. orders live in fixed-size chunks that are never
+// freed, so an order's 32-bit index stays valid for the life of the pool, and
+// unused orders are chained into a free list through their next link. chunks
+// are allocated through the policy's allocator in blocks of one or, for a
+// huge-page allocator, as many as fill a page. the pool holds its capacity
+// from construction; an empty pool on the matching path is refilled by one
+// block, while maintain() grows it geometrically ahead of demand.
+//
+// Layout decides how a chunk stores its orders: it names the Chunk type and
+// hands out a Ref, something with the accessors of Order, for a slot in one
+template <typename Policy, typename Layout> class SlabOrderPool {
+  using Chunk = typename Layout::Chunk;
+
 public:
-  OrderPool() : pool_{} {};
+  using OrderId = typename Policy::OrderId;
+  using Price = typename Policy::Price;
+  using Qty = typename Policy::Qty;
+  using Ref = typename Layout::Ref;
+  using ConstRef = typename Layout::ConstRef;
+
+  explicit SlabOrderPool(const BookCapacity &capacity = {})
+      : blocks_{}, chunks_{}, free_{nullOrder} {
+    reserve(capacity.orders);
+  };
+
+  // refills an empty pool by one block, on the matching path
+  void generateOrders();
+
+  // grows the pool to hold at least orders
+  void reserve(std::size_t orders) {
+    if (orders > capacity())
+      addChunks((orders - capacity() + ordersPerChunk - 1) / ordersPerChunk);
+  }
 
-  std::vector<std::shared_ptr<Order>> generateOrders(int numOrders);
-  std::shared_ptr<Order> allocate(OrderId id, Side side, OrderType type,
-                                  Qty qty, Price price) {
-    if (pool_.empty()) {
-      pool_ = generateOrders(defaultNumOrders);
+  // doubles the pool once less than a quarter of it is free. for idle time
+  void maintain() {
+    if (capacity() - inUse_ < capacity() / 4)
+      reserve(2 * capacity());
+  }
+
+  std::size_t capacity() const { return chunks_.size() * ordersPerChunk; }
+  std::size_t inUse() const { return inUse_; }
+  std::size_t highWater() const { return highWater_; }
+  uint64_t refills() const { return refills_; }
+
+  OrderIndex allocate(OrderId id, Side side, OrderType type, Qty qty,
+                      Price price) {
+    OpTimer timer{StatOp::ALLOCATE};
+    if (free_ == nullOrder) {
+      generateOrders();
     }
-    auto orderPointer = pool_.back();
-    orderPointer->setOrderId(id);
-    orderPointer->setSide(side);
-    orderPointer->setOrderType(type);
-    orderPointer->setInitialQty(qty);
-    orderPointer->setRemainingQty(qty);
-    orderPointer->setPrice(price);
-    return orderPointer;
+    OrderIndex index = free_;
+    auto &&order = (*this)[index];
+    free_ = order.getNext();
+    highWater_ = std::max(highWater_, ++inUse_);
+    order.setOrderId(id);
+    order.setSide(side);
+    order.setOrderType(type);
+    order.setInitialQty(qty);
+    order.setRemainingQty(qty);
+    order.setPrice(price);
+    order.setNext(nullOrder);
+    return index;
+  }
+
+  // hands a filled or cancelled order back for reuse
+  void release(OrderIndex index) {
+    (*this)[index].setNext(free_);
+    free_ = index;
+    --inUse_;
+  }
+
+  // hands back a whole chain of count orders linked through next_, head to
+  // tail
+  void release(OrderIndex head, OrderIndex tail, std::size_t count) {
+    (*this)[tail].setNext(free_);
+    free_ = head;
+    inUse_ -= count;
+  }
+
+  Ref operator[](OrderIndex index) {
+    return Layout::at(*chunks_[index / ordersPerChunk],
+                      index % ordersPerChunk);
+  }
+  ConstRef operator[](OrderIndex index) const {
+    return Layout::at(*chunks_[index / ordersPerChunk],
+                      index % ordersPerChunk);
   }
 
 private:
-  std::vector<std::shared_ptr<Order>> pool_;
-  static const int defaultNumOrders = 100;
+  static const OrderIndex ordersPerChunk = Layout::ordersPerChunk;
+
+  using Allocator = typename Policy::template Allocator<Chunk>;
+  static constexpr std::size_t chunksPerBlock =
+      std::max<std::size_t>(1, allocationGranule<Allocator> / sizeof(Chunk));
+
+  void addChunks(std::size_t chunks);
+
+  std::vector<std::vector<Chunk, Allocator>> blocks_;
+  std::vector<Chunk *> chunks_;
+  OrderIndex free_;
+  std::size_t inUse_ = 0;
+  std::size_t highWater_ = 0;
+  uint64_t refills_ = 0;
 };
 
-std::vector<std::shared_ptr<Order>> OrderPool::generateOrders(int numOrders) {
-  std::vector<std::shared_ptr<Order>> pool{};
-  for (int i = 0; i < numOrders; ++i) {
-    auto order = std::make_shared<Order>();
-    pool.emplace_back(order);
+template <typename Policy, typename Layout>
+void SlabOrderPool<Policy, Layout>::generateOrders() {
+  addChunks(chunksPerBlock);
+  countStat(StatCounter::POOL_REFILLS);
+  ++refills_;
+}
+
+// adds one block of at least the given number of chunks, rounded up to
+// whole blocks
+template <typename Policy, typename Layout>
+void SlabOrderPool<Policy, Layout>::addChunks(std::size_t chunks) {
+  chunks = (chunks + chunksPerBlock - 1) / chunksPerBlock * chunksPerBlock;
+  if (chunks > nullOrder / ordersPerChunk - chunks_.size())
+    throw std::length_error("order pool exhausted");
+  OrderIndex base = chunks_.size() * ordersPerChunk;
+  Chunk *block = blocks_.emplace_back(chunks).data();
+  for (std::size_t c = 0; c < chunks; ++c)
+    chunks_.push_back(block + c);
+  // lowest index ends up at the head of the free list
+  for (OrderIndex i = chunks * ordersPerChunk; i-- > 0;) {
+    auto &&order = Layout::at(block[i / ordersPerChunk], i % ordersPerChunk);
+    order.setNext(free_);
+    order.setPrev(nullOrder);
+    free_ = base + i;
   }
-  return pool;
 }
+
+// whole orders side by side
+template <typename Policy> struct OrderLayout {
+  static const OrderIndex ordersPerChunk = 4096;
+
+  struct Chunk {
+    BasicOrder<Policy> orders[ordersPerChunk];
+  };
+
+  using Ref = BasicOrder<Policy> &;
+  using ConstRef = const BasicOrder<Policy> &;
+
+  static Ref at(Chunk &chunk, OrderIndex slot) { return chunk.orders[slot]; }
+};
+
+template <typename Policy>
+using BasicOrderPool = SlabOrderPool<Policy, OrderLayout<Policy>>;
+
+// structure-of-arrays layout for books whose level walks are memory-bound.
+// each chunk keeps the fields matching touches (id, remaining qty and the
+// level links) in packed parallel arrays and the rest in a cold array, so a
+// sweep reads 16 bytes per order under the default policy instead of a
+// whole 40-byte Order. orders are reached through Ref, which has the
+// accessors of Order
+template <typename Policy> struct SplitLayout {
+  using OrderId = typename Policy::OrderId;
+  using Price = typename Policy::Price;
+  using Qty = typename Policy::Qty;
+
+  static const OrderIndex ordersPerChunk = 4096;
+
+  struct Cold {
+    Price price;
+    Qty initialQty;
+    OwnerTag owner;
+    Side side;
+    OrderType type;
+  };
+
+  struct Chunk {
+    OrderId id[ordersPerChunk];
+    Qty remainingQty[ordersPerChunk];
+    OrderIndex next[ordersPerChunk];
+    OrderIndex prev[ordersPerChunk];
+    Cold cold[ordersPerChunk];
+  };
+
+  class Ref {
+  public:
+    Ref(Chunk &chunk, OrderIndex slot) : chunk_{&chunk}, slot_{slot} {}
+
+    OrderId getOrderId() const { return chunk_->id[slot_]; }
+    Side getSide() const { return chunk_->cold[slot_].side; }
+    Price getPrice() const { return chunk_->cold[slot_].price; }
+    Qty getInitialQty() const { return chunk_->cold[slot_].initialQty; }
+    Qty getRemainingQty() const { return chunk_->remainingQty[slot_]; }
+    Qty getFilledQty() const { return getInitialQty() - getRemainingQty(); }
+    OrderIndex getPrev() const { return chunk_->prev[slot_]; }
+    OrderIndex getNext() const { return chunk_->next[slot_]; }
+    OwnerTag getOwner() const { return chunk_->cold[slot_].owner; }
+
+    void setOrderId(OrderId id) { chunk_->id[slot_] = id; }
+    void setSide(Side side) { chunk_->cold[slot_].side = side; }
+    void setOrderType(OrderType type) { chunk_->cold[slot_].type = type; }
+    void setPrice(Price price) { chunk_->cold[slot_].price = price; }
+    void setInitialQty(Qty qty) { chunk_->cold[slot_].initialQty = qty; }
+    void setRemainingQty(Qty qty) { chunk_->remainingQty[slot_] = qty; }
+    void setPrev(OrderIndex prev) { chunk_->prev[slot_] = prev; }
+    void setNext(OrderIndex next) { chunk_->next[slot_] = next; }
+    void setOwner(OwnerTag owner) { chunk_->cold[slot_].owner = owner; }
+
+    void fill(Qty exec) {
+      Qty &remaining = chunk_->remainingQty[slot_];
+      if (exec > remaining)
+        throw std::logic_error("overfill");
+      remaining -= exec;
+    }
+    bool isFilled() const { return getRemainingQty() == 0; }
+
+  private:
+    Chunk *chunk_;
+    OrderIndex slot_;
+  };
+
+  using ConstRef = const Ref;
+
+  static Ref at(Chunk &chunk, OrderIndex slot) { return Ref{chunk, slot}; }
+};
+
+template <typename Policy>
+using SplitOrderPool = SlabOrderPool<Policy, SplitLayout<Policy>>;
+
 // for logging purposes
-struct TradeInfo {
-  OrderId id_;
-  Price price_;
-  Qty qty_;
+template <typename Policy> struct BasicTradeInfo {
+  typename Policy::OrderId id_;
+  typename Policy::Price price_;
+  typename Policy::Qty qty_;
 };
 
-class Trade {
+template <typename Policy> class BasicTrade {
 public:
-  Trade(const TradeInfo &buy, const TradeInfo &sell)
+  using TradeInfo = BasicTradeInfo<Policy>;
+
+  BasicTrade(const TradeInfo &buy, const TradeInfo &sell)
       : buy_{buy}, sell_{sell} {};
-  const TradeInfo &getBuy() { return buy_; }
-  const TradeInfo &getSell() { return sell_; }
+  const TradeInfo &getBuy() const { return buy_; }
+  const TradeInfo &getSell() const { return sell_; }
 
 private:
   const TradeInfo buy_;
   const TradeInfo sell_;
 };
 
-using Trades = std::vector<Trade>;
-using Level = std::vector<std::shared_ptr<Order>>;
-using Handler = std::list<Order>::iterator;
-struct Handle {
+// trade sink that appends to a caller-owned Trades. reusing the same vector
+// across calls stops it allocating once it has grown to the largest burst
+template <typename Trades> struct AppendTrades {
+  Trades &trades;
+  template <typename Trade> void operator()(const Trade &trade) {
+    trades.push_back(trade);
+  }
+};
+
+enum class CommandType {
+  LIMIT,
+  MARKET,
+  CANCEL,
+  MODIFY,
+  REPLACE,
+  CANCEL_OWNER,
+  IOC,
+  FOK,
+  STOP,
+  STOP_LIMIT
+};
+
+// whether raw type and side values name a CommandType and a Side. the book
+// takes any side but BUY for SELL, so a command read from outside the
+// process is checked with this before it is executed
+inline bool knownCommand(uint32_t type, uint32_t side) {
+  return type <= static_cast<uint32_t>(CommandType::STOP_LIMIT) &&
+         side <= static_cast<uint32_t>(Side::SELL);
+}
+
+// one order-entry request in a form that can be queued, batched or replayed.
+// price is ignored for MARKET and MODIFY, side for CANCEL, MODIFY and
+// REPLACE, and id is only read by CANCEL, MODIFY and REPLACE. owner tags a
+// LIMIT and selects the orders of a CANCEL_OWNER. IOC and FOK read the same
+// fields as LIMIT, less owner. STOP reads what MARKET does and STOP_LIMIT
+// what LIMIT does, both with owner and with stopPrice as the trigger
+template <typename Policy> struct BasicCommand {
+  CommandType type;
+  Side side;
+  typename Policy::Price price;
+  typename Policy::Qty qty;
+  typename Policy::OrderId id;
+  OwnerTag owner;
+  typename Policy::Price stopPrice;
+};
+
+// fifo of the orders resting at one price, linked through the orders
+// themselves so append, unlink and pop are O(1) with no allocation. a cancel
+// unlinks its order at once: nothing has to shift, so leaving a tombstone
+// would save only the two neighbour writes and make every match, depth read
+// and snapshot step over dead entries
+template <typename Policy> struct BasicLevel {
+  using Qty = typename Policy::Qty;
+  using OrderPool = typename Policy::template Pool<Policy>;
+
+  OrderIndex head{nullOrder};
+  OrderIndex tail{nullOrder};
+  Qty totalQty{};
+  uint32_t orderCount{};
+
+  bool empty() const { return head == nullOrder; }
+
+  void push_back(OrderPool &pool, OrderIndex index) {
+    auto &&order = pool[index];
+    order.setPrev(tail);
+    order.setNext(nullOrder);
+    if (tail != nullOrder)
+      pool[tail].setNext(index);
+    else
+      head = index;
+    tail = index;
+    totalQty += order.getRemainingQty();
+    ++orderCount;
+  }
+
+  void erase(OrderPool &pool, OrderIndex index) {
+    auto &&order = pool[index];
+    OrderIndex prev = order.getPrev();
+    OrderIndex next = order.getNext();
+    if (prev != nullOrder)
+      pool[prev].setNext(next);
+    else
+      head = next;
+    if (next != nullOrder)
+      pool[next].setPrev(prev);
+    else
+      tail = prev;
+    order.setPrev(nullOrder);
+    order.setNext(nullOrder);
+    totalQty -= order.getRemainingQty();
+    --orderCount;
+  }
+
+  void pop_front(OrderPool &pool) { erase(pool, head); }
+
+  // fills a resting order of this level, keeping totalQty in step
+  template <typename Order> void fill(Order &&order, Qty exec) {
+    order.fill(exec);
+    totalQty -= exec;
+  }
+
+  // takes qty off a resting order without filling it, keeping its place
+  template <typename Order> void reduce(Order &&order, Qty qty) {
+    order.setInitialQty(order.getInitialQty() - qty);
+    order.setRemainingQty(order.getRemainingQty() - qty);
+    totalQty -= qty;
+  }
+};
+
+// one price level as published: the level's cached aggregates. a side with
+// no levels reads as a zero entry
+template <typename Policy> struct BasicDepthLevel {
+  typename Policy::Price price;
+  typename Policy::Qty qty;
+  uint32_t orders;
+};
+
+template <typename Policy> struct BasicTopOfBook {
+  BasicDepthLevel<Policy> bid;
+  BasicDepthLevel<Policy> ask;
+};
+
+template <typename Policy> struct BasicBookDepth {
+  std::vector<BasicDepthLevel<Policy>> bids;
+  std::vector<BasicDepthLevel<Policy>> asks;
+};
+
+// a level after it changed: its new aggregates, all zero once it is empty
+template <typename Policy> struct BasicLevelDelta {
   Side side;
-  Price price;
+  typename Policy::Price price;
+  typename Policy::Qty qty;
+  uint32_t orders;
+};
+
+// an order after a call changed it. a DONE order has left the book, filled,
+// cancelled or, for an immediate order, done trading, and the book keeps
+// nothing else about it. a pending stop's price is its trigger
+enum class OrderStatus : uint8_t { RESTING, PENDING_STOP, DONE };
+
+template <typename Policy> struct BasicOrderState {
+  typename Policy::OrderId id;
+  Side side;
+  OrderStatus status;
+  typename Policy::Price price;
+  typename Policy::Qty initialQty;
+  typename Policy::Qty remainingQty;
+};
+
+using Handler = OrderIndex;
+template <typename Policy> struct BasicHandle {
+  Side side;
+  typename Policy::Price price;
   Handler it;
 };
 
-class OrderBook {
+// order id -> handle map for the ids handed out by nextId(). ids are
+// monotone, so the table is a flat power-of-two window indexed by id and a
+// lookup is a single probe. a slot freed by a fill or cancel is reused once
+// the id counter comes round the window again; if it is still held by an
+// older resting order, that order moves to a flat open-addressed spill
+// table. maintain() widens the window once much of the book has spilled and
+// keeps the spill table sparse, so neither grows on the matching path while
+// the book is given idle time
+template <typename Policy> class DirectIdIndex {
 public:
-  OrderBook() : asks_{}, bids_{}, orderIdToIterator_{}, pool_{} {}
+  using OrderId = typename Policy::OrderId;
+  using Handle = BasicHandle<Policy>;
 
-  OrderId nextId() {
-    return nextOrderId_.fetch_add(1, std::memory_order_relaxed);
+  explicit DirectIdIndex(const BookCapacity &capacity = {})
+      : slots_(std::bit_ceil(
+            std::max<std::size_t>({capacity.idWindow, capacity.orders, 1}))),
+        spill_(minSpill), spilled_{0}, size_{0}, grows_{0} {}
+
+  std::size_t size() const { return size_; }
+  // spill table doublings on the matching path, each an allocation
+  uint64_t grows() const { return grows_; }
+
+  // widens the window to at least orders ids
+  void reserve(std::size_t orders) {
+    if (orders > slots_.size())
+      rebuild(std::bit_ceil(orders));
   }
-  Trades add_limit(Side side, Price price, Qty qty) {
-    OrderId id = nextId();
-    auto orderPointer = pool_.allocate(id, side, OrderType::LIMIT, qty, price);
-    Handler iterator;
 
-    if (side == Side::BUY) {
-      auto level = bids_[price];
-      level.push_back(orderPointer);
-      iterator = std::prev(level.end());
-    } else {
-      auto level = asks_[price];
-      level.push_back(orderPointer);
-      iterator = std::prev(level.end());
+  // for idle time: doubles the window once a quarter of its size has
+  // spilled, and the spill table once it is a quarter full
+  void maintain() {
+    if (spilled_ > slots_.size() / 4)
+      rebuild(slots_.size() * 2);
+    else if (spilled_ > spill_.size() / 4)
+      resizeSpill(spill_.size() * 2);
+  }
+
+  void insert(OrderId id, const Handle &handle) {
+    Slot &entry = slots_[slot(id)];
+    if (entry.id == id || (spilled_ != 0 && findSpill(id) != nullptr))
+      throw std::logic_error("duplicate order id");
+    if (entry.id != 0) {
+      if (2 * (spilled_ + 1) > spill_.size()) {
+        resizeSpill(spill_.size() * 2);
+        ++grows_;
+      }
+      spill(entry);
     }
-    Handle handle{side, price, iterator};
-    orderIdToIterator_.insert({id, handle});
-    return matchOrders();
+    entry = Slot{id, handle};
+    ++size_;
   }
 
-  Trades add_market(Side side, Qty qty) {
-    Trades trades{};
-    if (qty == 0)
-      return trades;
+  // id 0 would match any free slot, so it is never found
+  Handle *find(OrderId id) {
+    Slot &entry = slots_[slot(id)];
+    if (entry.id == id && id != 0)
+      return &entry.handle;
+    if (spilled_ == 0 || id == 0)
+      return nullptr;
+    Slot *spilt = findSpill(id);
+    return spilt ? &spilt->handle : nullptr;
+  }
 
-    OrderId marketId = nextId(); // synthetic id for the market order
+  const Handle *find(OrderId id) const {
+    return const_cast<DirectIdIndex *>(this)->find(id);
+  }
 
-    auto consume = [&](auto &opp) {
-      while (qty > 0 && !opp.empty()) {
-        auto best = opp.begin();
-        Price price = best->first;
-        Level &level = best->second;
-
-        for (auto it = level.begin(); it != level.end() && qty > 0;) {
-          Order &resting = *it;
-          Qty exec = std::min(qty, resting.getRemainingQty());
-
-          OrderId restingId = resting.getOrderId();
-          if (side == Side::BUY) {
-            trades.emplace_back(TradeInfo{marketId, price, exec}, // buy
-                                TradeInfo{restingId, price, exec} // sell
-            );
-          } else {
-            trades.emplace_back(TradeInfo{restingId, price, exec}, // buy
-                                TradeInfo{marketId, price, exec}   // sell
-            );
-          }
+  Handle &at(OrderId id) {
+    Handle *handle = find(id);
+    if (!handle)
+      throw std::out_of_range("unknown order id");
+    return *handle;
+  }
 
-          resting.fill(exec);
-          qty -= exec;
+  void erase(OrderId id) {
+    Slot &entry = slots_[slot(id)];
+    if (entry.id == id && id != 0) {
+      entry.id = 0;
+      --size_;
+    } else if (spilled_ != 0 && id != 0) {
+      eraseSpill(id);
+    }
+  }
 
-          if (resting.isFilled()) {
-            orderIdToIterator_.erase(restingId);
-            it = level.erase(it);
-          } else {
-            ++it;
-          }
-        }
+private:
+  // id 0 is never handed out, so it marks a free slot
+  struct Slot {
+    OrderId id;
+    Handle handle;
+  };
+
+  using Slots = std::vector<Slot, typename Policy::template Allocator<Slot>>;
+
+  static constexpr std::size_t minSpill = 64;
 
-        if (level.empty())
-          opp.erase(best);
+  std::size_t slot(OrderId id) const { return id & (slots_.size() - 1); }
+
+  // spilled ids are the ones that collided in the window, so they share
+  // low bits; a multiplicative hash spreads them over the spill table
+  std::size_t spillSlot(OrderId id) const {
+    return (static_cast<uint64_t>(id) * 0x9E3779B97F4A7C15ull) >>
+           (64 - std::countr_zero(spill_.size()));
+  }
+
+  std::size_t nextSpill(std::size_t i) const {
+    return (i + 1) & (spill_.size() - 1);
+  }
+
+  Slot *findSpill(OrderId id) {
+    for (std::size_t i = spillSlot(id); spill_[i].id != 0; i = nextSpill(i))
+      if (spill_[i].id == id)
+        return &spill_[i];
+    return nullptr;
+  }
+
+  // the caller keeps the spill table at most half full
+  void spill(const Slot &entry) {
+    std::size_t i = spillSlot(entry.id);
+    while (spill_[i].id != 0)
+      i = nextSpill(i);
+    spill_[i] = entry;
+    ++spilled_;
+  }
+
+  // backward-shift delete: later entries of the probe run move up into the
+  // hole, so the table needs no tombstones
+  void eraseSpill(OrderId id) {
+    Slot *found = findSpill(id);
+    if (!found)
+      return;
+    std::size_t hole = found - spill_.data();
+    for (std::size_t i = nextSpill(hole); spill_[i].id != 0; i = nextSpill(i)) {
+      std::size_t home = spillSlot(spill_[i].id);
+      // move it up unless its home lies cyclically in (hole, i]
+      if (((i - home) & (spill_.size() - 1)) >=
+          ((i - hole) & (spill_.size() - 1))) {
+        spill_[hole] = spill_[i];
+        hole = i;
       }
-    };
+    }
+    spill_[hole].id = 0;
+    --spilled_;
+    --size_;
+  }
 
-    if (side == Side::BUY)
-      consume(asks_); // buy market consumes asks
-    else
-      consume(bids_); // sell market consumes bids
+  void resizeSpill(std::size_t size);
+  void rebuild(std::size_t window);
+
+  Slots slots_;
+  // older orders whose window slot a newer id has taken
+  Slots spill_;
+  std::size_t spilled_;
+  std::size_t size_;
+  uint64_t grows_;
+};
+
+template <typename Policy>
+void DirectIdIndex<Policy>::resizeSpill(std::size_t size) {
+  Slots old(size);
+  std::swap(old, spill_);
+  spilled_ = 0;
+  for (const Slot &entry : old)
+    if (entry.id != 0)
+      spill(entry);
+}
+
+// re-places every order in a window of the given size. ids that collided in
+// the old window mostly land apart in the wider one and leave the spill table
+template <typename Policy>
+void DirectIdIndex<Policy>::rebuild(std::size_t window) {
+  Slots slots(window);
+  Slots spilt(minSpill);
+  std::swap(slots, slots_);
+  std::swap(spilt, spill_);
+  spilled_ = 0;
+  auto place = [&](const Slot &entry) {
+    Slot &target = slots_[slot(entry.id)];
+    if (target.id == 0) {
+      target = entry;
+      return;
+    }
+    if (2 * (spilled_ + 1) > spill_.size())
+      resizeSpill(spill_.size() * 2);
+    spill(entry.id < target.id ? entry : std::exchange(target, entry));
+  };
+  for (const Slot &entry : slots)
+    if (entry.id != 0)
+      place(entry);
+  for (const Slot &entry : spilt)
+    if (entry.id != 0)
+      place(entry);
+}
+
+// hashed id index. its size follows the number of resting orders rather than
+// the id span they cover, for books whose orders rest across many ids
+template <typename Policy> class HashIdIndex {
+public:
+  using OrderId = typename Policy::OrderId;
+  using Handle = BasicHandle<Policy>;
+
+  explicit HashIdIndex(const BookCapacity &capacity = {}) : map_{} {
+    map_.reserve(capacity.orders);
+  }
+
+  std::size_t size() const { return map_.size(); }
+  // rehashes. every insert also allocates a node, so this index never keeps
+  // the matching path allocation-free
+  uint64_t grows() const { return grows_; }
+
+  void reserve(std::size_t orders) { map_.reserve(orders); }
+
+  // for idle time: rehashes ahead of demand once the table is three
+  // quarters loaded
+  void maintain() {
+    if (4 * map_.size() > 3 * map_.max_load_factor() * map_.bucket_count())
+      map_.reserve(2 * map_.size());
+  }
+
+  void insert(OrderId id, const Handle &handle) {
+    std::size_t buckets = map_.bucket_count();
+    if (!map_.emplace(id, handle).second)
+      throw std::logic_error("duplicate order id");
+    grows_ += map_.bucket_count() != buckets;
+  }
+
+  Handle *find(OrderId id) {
+    auto it = map_.find(id);
+    return it == map_.end() ? nullptr : &it->second;
+  }
+
+  const Handle *find(OrderId id) const {
+    auto it = map_.find(id);
+    return it == map_.end() ? nullptr : &it->second;
+  }
+
+  Handle &at(OrderId id) {
+    Handle *handle = find(id);
+    if (!handle)
+      throw std::out_of_range("unknown order id");
+    return *handle;
+  }
+
+  void erase(OrderId id) { map_.erase(id); }
+
+private:
+  std::unordered_map<OrderId, Handle> map_;
+  uint64_t grows_ = 0;
+};
+
+// word scans over a ladder's occupancy bitmap. a sparse book can leave long
+// runs of empty words between levels, so these test 8 (AVX-512) or 4 (AVX2)
+// words per step before narrowing down to one
+
+// index of the first non-zero word in words[from, to), or to if there is none
+inline std::size_t nextNonZeroWord(const uint64_t *words, std::size_t from,
+                                   std::size_t to) {
+#if defined(__AVX512F__)
+  for (; from + 8 <= to; from += 8) {
+    __m512i v = _mm512_loadu_si512(words + from);
+    __mmask8 nonZero = _mm512_test_epi64_mask(v, v);
+    if (nonZero)
+      return from + std::countr_zero(static_cast<unsigned>(nonZero));
+  }
+#elif defined(__AVX2__)
+  for (; from + 4 <= to; from += 4) {
+    __m256i v = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i *>(words + from));
+    if (!_mm256_testz_si256(v, v))
+      break;
+  }
+#endif
+  while (from < to && words[from] == 0)
+    ++from;
+  return from;
+}
+
+// index of the last non-zero word in words[0, from], or SIZE_MAX if none
+inline std::size_t prevNonZeroWord(const uint64_t *words, std::size_t from) {
+  std::size_t end = from + 1; // words[end - 1] is the next one to test
+#if defined(__AVX512F__)
+  for (; end >= 8; end -= 8) {
+    __m512i v = _mm512_loadu_si512(words + end - 8);
+    __mmask8 nonZero = _mm512_test_epi64_mask(v, v);
+    if (nonZero)
+      return end - 8 + 31 - std::countl_zero(static_cast<uint32_t>(nonZero));
+  }
+#elif defined(__AVX2__)
+  for (; end >= 4; end -= 4) {
+    __m256i v = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i *>(words + end - 4));
+    if (!_mm256_testz_si256(v, v))
+      break;
+  }
+#endif
+  while (end > 0 && words[end - 1] == 0)
+    --end;
+  return end == 0 ? std::numeric_limits<std::size_t>::max() : end - 1;
+}
+
+// calls a level visitor; one that returns bool stops the visit with false
+template <typename Fn, typename Price, typename Level>
+bool visitLevel(Fn &fn, Price price, const Level &level) {
+  if constexpr (std::is_void_v<std::invoke_result_t<Fn &, Price,
+                                                    const Level &>>) {
+    fn(price, level);
+    return true;
+  } else {
+    return fn(price, level);
+  }
+}
+
+// contiguous array of levels over the tick window [basePrice, basePrice +
+// numTicks). a bitmap marks the non-empty ticks and best_ caches the best one,
+// which is the highest tick for BUY ladders and the lowest for SELL ladders.
+// count_ is the number of marked ticks, so walks stop at the last level
+// instead of scanning the rest of the window for another
+template <typename Policy, Side S> class PriceLadder {
+public:
+  using Price = typename Policy::Price;
+  using Level = BasicLevel<Policy>;
+
+  PriceLadder(Price basePrice, std::size_t numTicks)
+      : basePrice_{basePrice}, levels_(numTicks), bits_((numTicks + 63) / 64),
+        best_{npos}, count_{0} {}
+
+  bool empty() const { return best_ == npos; }
+  Price bestPrice() const { return basePrice_ + best_; }
+  Level &bestLevel() { return levels_[best_]; }
+
+  bool contains(Price price) const {
+    return price >= basePrice_ &&
+           static_cast<std::size_t>(price - basePrice_) < levels_.size();
+  }
 
+  Level &at(Price price) {
+    if (!contains(price))
+      throw std::out_of_range("price outside of ladder window");
+    return levels_[price - basePrice_];
+  }
+
+  const Level *find(Price price) const {
+    return contains(price) ? &levels_[price - basePrice_] : nullptr;
+  }
+
+  // calls fn(price, level) on up to n non-empty levels, best first
+  template <typename Fn> void visit(std::size_t n, Fn &&fn) const {
+    n = std::min(n, count_);
+    for (std::size_t tick = best_; n > 0; tick = after(tick)) {
+      if (!visitLevel(fn, static_cast<Price>(basePrice_ + tick),
+                      levels_[tick]) ||
+          --n == 0)
+        return;
+    }
+  }
+
+  // appends the prices of the non-empty levels within [low, high]
+  void collect(Price low, Price high, std::vector<Price> &out) const {
+    if (levels_.empty() || high < basePrice_)
+      return;
+    std::size_t first = low > basePrice_ ? low - basePrice_ : 0;
+    std::size_t last = std::min<std::size_t>(high - basePrice_,
+                                             levels_.size() - 1);
+    for (std::size_t tick = scanUp(first); tick != npos && tick <= last;
+         tick = scanUp(tick + 1))
+      out.push_back(static_cast<Price>(basePrice_ + tick));
+  }
+
+  // marks the level at price as non-empty, moving the cursor if it improves
+  void activate(Price price) {
+    std::size_t tick = price - basePrice_;
+    uint64_t bit = uint64_t{1} << (tick % 64);
+    count_ += (bits_[tick / 64] & bit) == 0;
+    bits_[tick / 64] |= bit;
+    if (best_ == npos || better(tick, best_))
+      best_ = tick;
+  }
+
+  // clears the level at price and, if it was the best, advances the cursor to
+  // the next non-empty tick
+  void erase(Price price) {
+    std::size_t tick = price - basePrice_;
+    uint64_t bit = uint64_t{1} << (tick % 64);
+    levels_[tick] = Level{};
+    count_ -= (bits_[tick / 64] & bit) != 0;
+    bits_[tick / 64] &= ~bit;
+    if (tick == best_)
+      best_ = count_ == 0 ? npos : after(tick);
+  }
+
+private:
+  static constexpr std::size_t npos = std::numeric_limits<std::size_t>::max();
+
+  static bool better(std::size_t a, std::size_t b) {
+    return S == Side::BUY ? a > b : a < b;
+  }
+
+  // the next non-empty tick past tick, moving away from the best price
+  std::size_t after(std::size_t tick) const {
+    if (S == Side::BUY)
+      return tick == 0 ? npos : scanDown(tick - 1);
+    return scanUp(tick + 1);
+  }
+
+  // first non-empty tick >= tick
+  std::size_t scanUp(std::size_t tick) const {
+    std::size_t w = tick / 64;
+    if (w >= bits_.size())
+      return npos;
+    uint64_t word = bits_[w] & (~uint64_t{0} << (tick % 64));
+    if (word)
+      return w * 64 + std::countr_zero(word);
+    w = nextNonZeroWord(bits_.data(), w + 1, bits_.size());
+    if (w == bits_.size())
+      return npos;
+    return w * 64 + std::countr_zero(bits_[w]);
+  }
+
+  // last non-empty tick <= tick
+  std::size_t scanDown(std::size_t tick) const {
+    std::size_t w = tick / 64;
+    uint64_t word = bits_[w] & (~uint64_t{0} >> (63 - tick % 64));
+    if (word)
+      return w * 64 + 63 - std::countl_zero(word);
+    if (w == 0)
+      return npos;
+    w = prevNonZeroWord(bits_.data(), w - 1);
+    if (w == npos)
+      return npos;
+    return w * 64 + 63 - std::countl_zero(bits_[w]);
+  }
+
+  template <typename T>
+  using Vector = std::vector<T, typename Policy::template Allocator<T>>;
+
+  Price basePrice_;
+  Vector<Level> levels_;
+  Vector<uint64_t> bits_;
+  std::size_t best_;
+  std::size_t count_;
+};
+
+// tree of levels with the same interface as PriceLadder, for price ranges too
+// wide or sparse for a dense window. the window arguments are ignored
+template <typename Policy, Side S> class LevelMap {
+public:
+  using Price = typename Policy::Price;
+  using Level = BasicLevel<Policy>;
+
+  LevelMap(Price, std::size_t) : levels_{} {}
+
+  bool empty() const { return levels_.empty(); }
+  Price bestPrice() const { return levels_.begin()->first; }
+  Level &bestLevel() { return levels_.begin()->second; }
+
+  bool contains(Price) const { return true; }
+  Level &at(Price price) { return levels_[price]; }
+
+  const Level *find(Price price) const {
+    auto it = levels_.find(price);
+    return it == levels_.end() ? nullptr : &it->second;
+  }
+
+  template <typename Fn> void visit(std::size_t n, Fn &&fn) const {
+    for (auto it = levels_.begin(); it != levels_.end() && n > 0; ++it, --n)
+      if (!visitLevel(fn, it->first, it->second))
+        return;
+  }
+
+  void collect(Price low, Price high, std::vector<Price> &out) const {
+    if (low > high)
+      return;
+    // the map runs best first, so a BUY map runs from high down to low
+    auto it = levels_.lower_bound(S == Side::BUY ? high : low);
+    auto end = levels_.upper_bound(S == Side::BUY ? low : high);
+    for (; it != end; ++it)
+      out.push_back(it->first);
+  }
+
+  void activate(Price) {}
+  void erase(Price price) { levels_.erase(price); }
+
+private:
+  using Compare = std::conditional_t<S == Side::BUY, std::greater<Price>,
+                                     std::less<Price>>;
+
+  std::map<Price, Level, Compare> levels_;
+};
+
+// the default book: 32-bit prices and quantities over a price ladder, indexed
+// by the direct-mapped id table
+struct DefaultPolicy {
+  using OrderId = uint64_t;
+  using Price = uint32_t;
+  using Qty = uint32_t;
+  template <typename P, Side S> using Levels = PriceLadder<P, S>;
+  template <typename P> using IdIndex = DirectIdIndex<P>;
+  template <typename P> using Pool = BasicOrderPool<P>;
+  template <typename T> using Allocator = std::allocator<T>;
+};
+
+// narrow-tick instruments: 16-bit prices, so a ladder can span every price
+struct CompactPolicy : DefaultPolicy {
+  using Price = uint16_t;
+};
+
+// orders stored as structure-of-arrays, for sweep-heavy books
+struct SplitPolicy : DefaultPolicy {
+  template <typename P> using Pool = SplitOrderPool<P>;
+};
+
+// wide or sparse instruments: 64-bit prices and quantities on tree levels
+struct WidePolicy : DefaultPolicy {
+  using Price = uint64_t;
+  using Qty = uint64_t;
+  template <typename P, Side S> using Levels = LevelMap<P, S>;
+  template <typename P> using IdIndex = HashIdIndex<P>;
+};
+
+// latency-critical books: the pool, id index and ladders on huge pages,
+// faulted in as they are allocated. HugePageAllocator<T, true> also locks
+// them into memory
+struct HugePagePolicy : DefaultPolicy {
+  template <typename T> using Allocator = HugePageAllocator<T>;
+};
+
+// what an instrument may trade at. outside the book prices are fixed-point
+// integers (say in 1/10000ths); the book itself works in ticks, price /
+// tickSize, so its levels are dense. the gateway converts with toTicks,
+// which rejects off-tick and out-of-band prices, and a book built from the
+// instrument sizes its ladder to exactly the band and enforces it
+template <typename Policy> class BasicInstrument {
+public:
+  using Price = typename Policy::Price;
+
+  // the default instrument is the identity: one unit per tick, no band
+  BasicInstrument()
+      : tickSize_{1}, minPrice_{0},
+        maxPrice_{std::numeric_limits<Price>::max()}, lowTick_{0},
+        highTick_{std::numeric_limits<Price>::max()} {}
+  BasicInstrument(uint64_t tickSize, uint64_t minPrice, uint64_t maxPrice)
+      : tickSize_{tickSize}, minPrice_{minPrice}, maxPrice_{maxPrice},
+        lowTick_{}, highTick_{} {
+    if (tickSize == 0 || minPrice > maxPrice || minPrice % tickSize != 0 ||
+        maxPrice % tickSize != 0)
+      throw std::invalid_argument("price band must run from tick to tick");
+    if (maxPrice / tickSize > std::numeric_limits<Price>::max())
+      throw std::out_of_range("price band does not fit the price type");
+    lowTick_ = minPrice / tickSize;
+    highTick_ = maxPrice / tickSize;
+  }
+
+  uint64_t tickSize() const { return tickSize_; }
+  Price lowTick() const { return lowTick_; }
+  Price highTick() const { return highTick_; }
+  std::size_t numTicks() const {
+    return static_cast<std::size_t>(highTick_ - lowTick_) + 1;
+  }
+
+  Price toTicks(uint64_t price) const {
+    if (price < minPrice_ || price > maxPrice_)
+      throw std::out_of_range("price outside of price band");
+    if (price % tickSize_ != 0)
+      throw std::invalid_argument("price is not on a tick");
+    return price / tickSize_;
+  }
+
+  uint64_t toPrice(Price ticks) const { return ticks * tickSize_; }
+
+private:
+  uint64_t tickSize_;
+  uint64_t minPrice_;
+  uint64_t maxPrice_;
+  Price lowTick_;
+  Price highTick_;
+};
+
+// a snapshot image is a SnapshotHeader followed by numOrders fixed-size
+// records, one per resting order, then numStops more for the pending stops.
+// it holds no pointers or pool indices, so it can be written out as is and
+// mapped back. lastPrice is the last trade price, if hasTraded is set
+struct SnapshotHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t recordSize;
+  uint64_t nextOrderId;
+  uint64_t numOrders;
+  uint64_t numStops;
+  uint64_t lastPrice;
+  uint64_t hasTraded;
+};
+
+inline constexpr char snapshotMagic[8] = {'O', 'B', 'S', 'N',
+                                          'A', 'P', 'S', 'H'};
+inline constexpr uint32_t snapshotVersion = 3;
+
+// type is LIMIT for a resting order. a stop's record has its trigger and,
+// for a STOP_LIMIT, the price it will rest at
+template <typename Policy> struct BasicSnapshotRecord {
+  typename Policy::OrderId id;
+  typename Policy::Price price;
+  typename Policy::Qty initialQty;
+  typename Policy::Qty remainingQty;
+  OwnerTag owner;
+  Side side;
+  OrderType type;
+  typename Policy::Price trigger;
+};
+
+// where a book's memory stands. poolRefills and indexGrows count the
+// allocations made on the matching path; a book sized for its peak keeps
+// both at 0
+struct MemoryStats {
+  std::size_t poolCapacity;
+  std::size_t ordersInUse;
+  std::size_t ordersHighWater;
+  uint64_t poolRefills;
+  uint64_t indexGrows;
+};
+
+template <typename Policy = DefaultPolicy> class BasicOrderBook {
+public:
+  using OrderId = typename Policy::OrderId;
+  using Price = typename Policy::Price;
+  using Qty = typename Policy::Qty;
+  using Order = BasicOrder<Policy>;
+  using OrderPool = typename Policy::template Pool<Policy>;
+  using TradeInfo = BasicTradeInfo<Policy>;
+  using Trade = BasicTrade<Policy>;
+  using Trades = std::vector<Trade>;
+  using Level = BasicLevel<Policy>;
+  using Handle = BasicHandle<Policy>;
+  using Command = BasicCommand<Policy>;
+  using DepthLevel = BasicDepthLevel<Policy>;
+  using TopOfBook = BasicTopOfBook<Policy>;
+  using BookDepth = BasicBookDepth<Policy>;
+  using LevelDelta = BasicLevelDelta<Policy>;
+  using DeltaHook = std::function<void(const LevelDelta &)>;
+  using OrderState = BasicOrderState<Policy>;
+  using OrderHook = std::function<void(std::span<const OrderState>)>;
+  using SnapshotRecord = BasicSnapshotRecord<Policy>;
+  using Instrument = BasicInstrument<Policy>;
+
+  BasicOrderBook(Price basePrice = 0, std::size_t numTicks = defaultNumTicks,
+                 const BookCapacity &capacity = {})
+      : asks_{basePrice, numTicks}, bids_{basePrice, numTicks},
+        orderIdToIterator_{capacity}, pool_{capacity}, deltaHook_{},
+        dirtyBids_{}, dirtyAsks_{}, instrument_{} {}
+
+  // a book over the instrument's band, taking prices in its ticks. a price
+  // outside the band is rejected before it reaches the levels
+  explicit BasicOrderBook(const Instrument &instrument,
+                          const BookCapacity &capacity = {})
+      : asks_{instrument.lowTick(), instrument.numTicks()},
+        bids_{instrument.lowTick(), instrument.numTicks()},
+        orderIdToIterator_{capacity}, pool_{capacity}, deltaHook_{},
+        dirtyBids_{}, dirtyAsks_{}, instrument_{instrument} {}
+
+  const Instrument &instrument() const { return instrument_; }
+
+  // installs the L2 feed: after every add_limit, add_market, matchOrders or
+  // cancel the hook gets one delta per level the call changed, however many
+  // fills it took there. an empty hook turns the feed off
+  void set_delta_hook(DeltaHook hook) { deltaHook_ = std::move(hook); }
+
+  // installs the order feed: at the end of every call that changed orders
+  // the hook gets the state of each one it changed, after that call's level
+  // deltas. an order that traded several times in the call may be listed
+  // more than once, each time with its state at the end of the call. an
+  // empty hook turns the feed off
+  void set_order_hook(OrderHook hook) { orderHook_ = std::move(hook); }
+
+  OrderId nextId() {
+    return nextOrderId_.fetch_add(1, std::memory_order_relaxed);
+  }
+  Trades add_limit(Side side, Price price, Qty qty) {
+    Trades trades;
+    add_limit(side, price, qty, AppendTrades<Trades>{trades});
+    return trades;
+  }
+
+  Trades add_market(Side side, Qty qty) {
+    Trades trades;
+    add_market(side, qty, AppendTrades<Trades>{trades});
     return trades;
   }
 
   Trades matchOrders() {
     Trades trades;
-    trades.reserve(orderIdToIterator_.size());
+    matchOrders(AppendTrades<Trades>{trades});
+    return trades;
+  }
+
+  // the sink overloads report each execution as sink(const Trade &) instead
+  // of building a Trades vector, and return the id given to the new order (0
+  // for a market order of no quantity). a limit order can carry an owner tag
+  template <typename Sink>
+  OrderId add_limit(Side side, Price price, Qty qty, Sink &&sink,
+                    OwnerTag owner = 0) {
+    OpTimer timer{StatOp::ADD_LIMIT};
+    OrderId id = side == Side::BUY
+                     ? addLimit<Side::BUY>(price, qty, sink, owner)
+                     : addLimit<Side::SELL>(price, qty, sink, owner);
+    triggerStops(sink);
+    publishDeltas();
+    return id;
+  }
+
+  template <typename Sink>
+  OrderId add_market(Side side, Qty qty, Sink &&sink) {
+    OpTimer timer{StatOp::ADD_MARKET};
+    OrderId id = side == Side::BUY ? addMarket<Side::BUY>(qty, sink)
+                                   : addMarket<Side::SELL>(qty, sink);
+    triggerStops(sink);
+    publishDeltas();
+    return id;
+  }
+
+  Trades add_ioc(Side side, Price price, Qty qty) {
+    Trades trades;
+    add_ioc(side, price, qty, AppendTrades<Trades>{trades});
+    return trades;
+  }
+
+  Trades add_fok(Side side, Price price, Qty qty) {
+    Trades trades;
+    add_fok(side, price, qty, AppendTrades<Trades>{trades});
+    return trades;
+  }
+
+  // immediate orders with a limit price: they trade against the opposite
+  // side as a limit order would but never rest. an IOC's unfilled quantity
+  // is dropped; a FOK trades in full or not at all. both return the id
+  // their trades carry, which is consumed even by a killed FOK
+  template <typename Sink>
+  OrderId add_ioc(Side side, Price price, Qty qty, Sink &&sink) {
+    OpTimer timer{StatOp::ADD_IOC};
+    OrderId id =
+        side == Side::BUY
+            ? addImmediate<Side::BUY, OrderType::IOC>(price, qty, sink)
+            : addImmediate<Side::SELL, OrderType::IOC>(price, qty, sink);
+    triggerStops(sink);
+    publishDeltas();
+    return id;
+  }
+
+  template <typename Sink>
+  OrderId add_fok(Side side, Price price, Qty qty, Sink &&sink) {
+    OpTimer timer{StatOp::ADD_FOK};
+    OrderId id =
+        side == Side::BUY
+            ? addImmediate<Side::BUY, OrderType::FOK>(price, qty, sink)
+            : addImmediate<Side::SELL, OrderType::FOK>(price, qty, sink);
+    triggerStops(sink);
+    publishDeltas();
+    return id;
+  }
+
+  Trades add_stop(Side side, Price trigger, Qty qty) {
+    Trades trades;
+    add_stop(side, trigger, qty, AppendTrades<Trades>{trades});
+    return trades;
+  }
+
+  Trades add_stop_limit(Side side, Price trigger, Price price, Qty qty) {
+    Trades trades;
+    add_stop_limit(side, trigger, price, qty, AppendTrades<Trades>{trades});
+    return trades;
+  }
+
+  // stop orders wait off the book until a trade prints at or through their
+  // trigger: at or above it for a buy, at or below it for a sell. a stop
+  // then enters as a market order, a stop limit as a limit order at price,
+  // under the id returned here. one whose trigger the last trade has already
+  // reached enters at once. a pending stop can be cancelled, alone or with
+  // its owner's orders, but not modified or replaced
+  template <typename Sink>
+  OrderId add_stop(Side side, Price trigger, Qty qty, Sink &&sink,
+                   OwnerTag owner = 0) {
+    OpTimer timer{StatOp::ADD_STOP};
+    OrderId id = side == Side::BUY
+                     ? addStop<Side::BUY>(OrderType::STOP, trigger, 0, qty,
+                                          sink, owner)
+                     : addStop<Side::SELL>(OrderType::STOP, trigger, 0, qty,
+                                           sink, owner);
+    publishDeltas();
+    return id;
+  }
+
+  template <typename Sink>
+  OrderId add_stop_limit(Side side, Price trigger, Price price, Qty qty,
+                         Sink &&sink, OwnerTag owner = 0) {
+    OpTimer timer{StatOp::ADD_STOP};
+    OrderId id = side == Side::BUY
+                     ? addStop<Side::BUY>(OrderType::STOP_LIMIT, trigger,
+                                          price, qty, sink, owner)
+                     : addStop<Side::SELL>(OrderType::STOP_LIMIT, trigger,
+                                           price, qty, sink, owner);
+    publishDeltas();
+    return id;
+  }
+
+  // stops waiting for their trigger
+  std::size_t pending_stops() const { return stopIndex_.size(); }
+
+  // applies one command, returning the id it assigned or changed (0 for
+  // CANCEL_OWNER)
+  template <typename Sink>
+  OrderId execute(const Command &command, Sink &&sink) {
+    switch (command.type) {
+    case CommandType::LIMIT:
+      return add_limit(command.side, command.price, command.qty, sink,
+                       command.owner);
+    case CommandType::MARKET:
+      return add_market(command.side, command.qty, sink);
+    case CommandType::CANCEL:
+      cancel(command.id);
+      return command.id;
+    case CommandType::MODIFY:
+      modify(command.id, command.qty);
+      return command.id;
+    case CommandType::REPLACE:
+      replace(command.id, command.price, command.qty, sink);
+      return command.id;
+    case CommandType::CANCEL_OWNER:
+      cancel_owner(command.owner);
+      return 0;
+    case CommandType::IOC:
+      return add_ioc(command.side, command.price, command.qty, sink);
+    case CommandType::FOK:
+      return add_fok(command.side, command.price, command.qty, sink);
+    case CommandType::STOP:
+      return add_stop(command.side, command.stopPrice, command.qty, sink,
+                      command.owner);
+    case CommandType::STOP_LIMIT:
+      return add_stop_limit(command.side, command.stopPrice, command.price,
+                            command.qty, sink, command.owner);
+    }
+    throw std::invalid_argument("unknown command type");
+  }
+
+  Trades submit_batch(std::span<const Command> commands) {
+    Trades trades;
+    submit_batch(commands, AppendTrades<Trades>{trades});
+    return trades;
+  }
+
+  // applies a batch of commands in order, reporting all of their executions
+  // to the one sink and, when ids is given, writing each command's id to it.
+  // the trades are exactly those of executing the commands one by one; a
+  // command that throws leaves the commands before it applied
+  template <typename Sink>
+  void submit_batch(std::span<const Command> commands, Sink &&sink,
+                    std::span<OrderId> ids = {}) {
+    for (std::size_t i = 0; i < commands.size(); ++i) {
+      OrderId id = execute(commands[i], sink);
+      if (i < ids.size())
+        ids[i] = id;
+    }
+  }
 
-    while (true) {
-      auto &[bestAsk, asks] = *asks_.begin();
-      auto &[bestBid, bids] = *bids_.begin();
+  template <typename Sink> void matchOrders(Sink &&sink) {
+    OpTimer timer{StatOp::MATCH};
+    while (!asks_.empty() && !bids_.empty()) {
+      Price bestAsk = asks_.bestPrice();
+      Price bestBid = bids_.bestPrice();
       if (bestAsk > bestBid)
         break;
-      auto &bid = bids.front();
-      auto &ask = asks.front();
+      Level &asks = asks_.bestLevel();
+      Level &bids = bids_.bestLevel();
+      OrderIndex bidIndex = bids.head;
+      OrderIndex askIndex = asks.head;
+      auto &&bid = pool_[bidIndex];
+      auto &&ask = pool_[askIndex];
 
       Qty exec = std::min(bid.getRemainingQty(), ask.getRemainingQty());
-      bid.fill(exec);
-      ask.fill(exec);
+      bids.fill(bid, exec);
+      asks.fill(ask, exec);
+      touch<Side::BUY>(bestBid);
+      touch<Side::SELL>(bestAsk);
+      sink(Trade{TradeInfo{bid.getOrderId(), bestBid, exec},
+                 TradeInfo{ask.getOrderId(), bestAsk, exec}});
+      countStat(StatCounter::TRADES);
+      // the order that was there first sets the price
+      setLastPrice(bid.getOrderId() < ask.getOrderId() ? bestBid : bestAsk);
+      touchOrder(bid.getOrderId());
+      touchOrder(ask.getOrderId());
 
       if (bid.isFilled()) {
-        bids.pop_front();
+        bids.pop_front(pool_);
         orderIdToIterator_.erase(bid.getOrderId());
+        pool_.release(bidIndex);
       }
       if (ask.isFilled()) {
-        asks.pop_front();
-        orderIdToIterator_.erase(bid.getOrderId());
+        asks.pop_front(pool_);
+        orderIdToIterator_.erase(ask.getOrderId());
+        pool_.release(askIndex);
       }
 
       if (asks.empty()) {
         asks_.erase(bestAsk);
+        countStat(StatCounter::LEVELS_TOUCHED);
       }
       if (bids.empty()) {
         bids_.erase(bestBid);
+        countStat(StatCounter::LEVELS_TOUCHED);
       }
-
-      trades.emplace_back(TradeInfo{bid.getOrderId(), bid.getPrice(), exec},
-                          TradeInfo{ask.getOrderId(), ask.getPrice(), exec});
     }
-    return trades;
+    triggerStops(sink);
+    publishDeltas();
   }
 
   void cancel(OrderId id) {
-    auto &[side, price, it] = orderIdToIterator_[id];
+    OpTimer timer{StatOp::CANCEL};
+    Handle *handle = orderIdToIterator_.find(id);
+    if (handle == nullptr) {
+      cancelStop(id);
+      publishDeltas();
+      return;
+    }
+    auto [side, price, it] = *handle;
     if (side == Side::BUY) {
-      bids_[price].erase(it);
+      unlink<Side::BUY>(price, it);
     } else {
-      asks_[price].erase(it);
+      unlink<Side::SELL>(price, it);
     }
     orderIdToIterator_.erase(id);
+    pool_.release(it);
+    touchOrder(id);
+    publishDeltas();
+  }
+
+  // sets a resting order's open quantity to qty. a reduction is made in
+  // place and keeps the order's place in its queue; an increase sends it to
+  // the back, as the order would be if it were new. qty 0 cancels it
+  void modify(OrderId id, Qty qty) {
+    OpTimer timer{StatOp::MODIFY};
+    if (qty == 0)
+      return cancel(id);
+    Handle handle = orderIdToIterator_.at(id);
+    if (handle.side == Side::BUY)
+      resize<Side::BUY>(handle, qty);
+    else
+      resize<Side::SELL>(handle, qty);
+    touchOrder(id);
+    publishDeltas();
+  }
+
+  Trades replace(OrderId id, Price price, Qty qty) {
+    Trades trades;
+    replace(id, price, qty, AppendTrades<Trades>{trades});
+    return trades;
+  }
+
+  // moves a resting order to price with open quantity qty, keeping its id,
+  // its pooled Order and its index slot. at the same price this is modify();
+  // at a new price the order joins the back of that level, and if the price
+  // crosses it trades first, as an incoming limit order would
+  template <typename Sink>
+  void replace(OrderId id, Price price, Qty qty, Sink &&sink) {
+    OpTimer timer{StatOp::REPLACE};
+    if (qty == 0)
+      throw std::logic_error("cannot create order with no quantity!");
+    Handle handle = orderIdToIterator_.at(id);
+    if (handle.price == price)
+      return modify(id, qty);
+    if (handle.side == Side::BUY)
+      move<Side::BUY>(id, handle, price, qty, sink);
+    else
+      move<Side::SELL>(id, handle, price, qty, sink);
+    triggerStops(sink);
+    publishDeltas();
+  }
+
+  // mass cancels, each returning how many orders it removed. whole levels
+  // are dropped at once: their orders leave the id index in one walk and go
+  // back to the pool as one chain, with no per-order unlinking. cancel_side
+  // takes the side's pending stops as well
+  std::size_t cancel_side(Side side) {
+    auto all = [](const Stop &) { return true; };
+    std::size_t stops = side == Side::BUY ? cancelStops<Side::BUY>(all)
+                                          : cancelStops<Side::SELL>(all);
+    return stops + cancel_range(side, std::numeric_limits<Price>::min(),
+                                std::numeric_limits<Price>::max());
+  }
+
+  // every order of one side priced within [low, high]
+  std::size_t cancel_range(Side side, Price low, Price high) {
+    OpTimer timer{StatOp::MASS_CANCEL};
+    std::size_t cancelled = side == Side::BUY
+                                ? cancelRange<Side::BUY>(low, high)
+                                : cancelRange<Side::SELL>(low, high);
+    publishDeltas();
+    return cancelled;
+  }
+
+  // every order entered with this owner tag, pending stops included. owners
+  // share levels, so this walks every resting order, but a level left with
+  // none of its orders is still dropped whole
+  std::size_t cancel_owner(OwnerTag owner) {
+    OpTimer timer{StatOp::MASS_CANCEL};
+    auto owned = [&](const Stop &stop) { return stop.owner == owner; };
+    std::size_t cancelled =
+        cancelOwner<Side::BUY>(owner) + cancelOwner<Side::SELL>(owner) +
+        cancelStops<Side::BUY>(owned) + cancelStops<Side::SELL>(owned);
+    publishDeltas();
+    return cancelled;
+  }
+
+  // housekeeping for when the matching thread is idle: grows the order pool
+  // and the id index ahead of demand once they run low, so matching does not
+  // have to
+  void maintain() {
+    pool_.maintain();
+    orderIdToIterator_.maintain();
+  }
+
+  MemoryStats memory_stats() const {
+    return {pool_.capacity(), pool_.inUse(), pool_.highWater(),
+            pool_.refills(), orderIdToIterator_.grows()};
+  }
+
+  // where an order stands now. an id the book no longer holds, or never
+  // gave out, is DONE
+  OrderState order_state(OrderId id) const {
+    if (const Handle *handle = orderIdToIterator_.find(id)) {
+      auto &&order = pool_[handle->it];
+      return {id,
+              handle->side,
+              OrderStatus::RESTING,
+              handle->price,
+              order.getInitialQty(),
+              order.getRemainingQty()};
+    }
+    auto stop = stopIndex_.find(id);
+    if (stop == stopIndex_.end())
+      return {id, Side::BUY, OrderStatus::DONE, 0, 0, 0};
+    auto [side, trigger] = stop->second;
+    Qty qty = side == Side::BUY ? buyStops_.at({trigger, id}).qty
+                                : sellStops_.at({trigger, id}).qty;
+    return {id, side, OrderStatus::PENDING_STOP, trigger, qty, qty};
+  }
+
+  // best bid and ask, read from the cached level aggregates in O(1)
+  TopOfBook top_of_book() const {
+    return TopOfBook{best<Side::BUY>(), best<Side::SELL>()};
+  }
+
+  // the aggregates of a single level; zero if nothing rests there
+  DepthLevel level_at(Side side, Price price) const {
+    const Level *level = side == Side::BUY ? bids_.find(price)
+                                           : asks_.find(price);
+    if (!level || level->empty())
+      return DepthLevel{price, 0, 0};
+    return DepthLevel{price, level->totalQty, level->orderCount};
+  }
+
+  // the n best levels of each side
+  BookDepth depth(std::size_t n) const {
+    BookDepth snapshot{std::vector<DepthLevel>(n), std::vector<DepthLevel>(n)};
+    snapshot.bids.resize(depth(Side::BUY, snapshot.bids));
+    snapshot.asks.resize(depth(Side::SELL, snapshot.asks));
+    return snapshot;
+  }
+
+  // fills out with the best levels of one side, returning how many there were
+  std::size_t depth(Side side, std::span<DepthLevel> out) const {
+    if (side == Side::BUY)
+      return depthOf<Side::BUY>(out);
+    return depthOf<Side::SELL>(out);
+  }
+
+  // the resting orders, the pending stops, the last trade price and the id
+  // counter as one image: bids then asks, each level's orders in time
+  // priority, then buy and sell stops in the order they would fire
+  std::vector<char> snapshot() const {
+    SnapshotHeader header{};
+    std::memcpy(header.magic, snapshotMagic, sizeof(snapshotMagic));
+    header.version = snapshotVersion;
+    header.recordSize = sizeof(SnapshotRecord);
+    header.nextOrderId = nextOrderId_.load(std::memory_order_relaxed);
+    header.numOrders = orderIdToIterator_.size();
+    header.numStops = stopIndex_.size();
+    header.lastPrice = lastPrice_;
+    header.hasTraded = hasTraded_;
+
+    std::vector<char> image(sizeof(header) +
+                            (header.numOrders + header.numStops) *
+                                sizeof(SnapshotRecord));
+    std::memcpy(image.data(), &header, sizeof(header));
+    char *out = image.data() + sizeof(header);
+    auto write = [&](Price price, const Level &level) {
+      for (OrderIndex i = level.head; i != nullOrder; i = pool_[i].getNext()) {
+        auto &&order = pool_[i];
+        // cleared first so padding bytes are the same in every image
+        SnapshotRecord record;
+        std::memset(&record, 0, sizeof(record));
+        record.id = order.getOrderId();
+        record.price = price;
+        record.initialQty = order.getInitialQty();
+        record.remainingQty = order.getRemainingQty();
+        record.owner = order.getOwner();
+        record.side = order.getSide();
+        record.type = OrderType::LIMIT;
+        std::memcpy(out, &record, sizeof(record));
+        out += sizeof(record);
+      }
+    };
+    bids_.visit(std::numeric_limits<std::size_t>::max(), write);
+    asks_.visit(std::numeric_limits<std::size_t>::max(), write);
+    auto writeStop = [&](Side side, const auto &entry) {
+      SnapshotRecord record;
+      std::memset(&record, 0, sizeof(record));
+      record.id = entry.first.second;
+      record.price = entry.second.price;
+      record.initialQty = entry.second.qty;
+      record.remainingQty = entry.second.qty;
+      record.owner = entry.second.owner;
+      record.side = side;
+      record.type = entry.second.type;
+      record.trigger = entry.first.first;
+      std::memcpy(out, &record, sizeof(record));
+      out += sizeof(record);
+    };
+    for (auto &entry : buyStops_)
+      writeStop(Side::BUY, entry);
+    for (auto &entry : sellStops_)
+      writeStop(Side::SELL, entry);
+    return image;
+  }
+
+  // loads a snapshot() image into an empty book built with a ladder window
+  // that covers the image's prices. orders are appended to their levels in
+  // image order, so time priority carries over, and nothing is matched: the
+  // pool hands out consecutive indices, so each level's queue comes back
+  // contiguous. stops come back pending, and none fires until the next
+  // trade. no deltas are published. a bad image throws and may leave the
+  // book partly loaded
+  void restore(std::span<const char> image) {
+    if (orderIdToIterator_.size() != 0 || !stopIndex_.empty())
+      throw std::logic_error("restore needs an empty book");
+    SnapshotHeader header;
+    if (image.size() < sizeof(header))
+      throw std::invalid_argument("not a snapshot of this book");
+    std::memcpy(&header, image.data(), sizeof(header));
+    if (std::memcmp(header.magic, snapshotMagic, sizeof(snapshotMagic)) != 0 ||
+        header.version != snapshotVersion ||
+        header.recordSize != sizeof(SnapshotRecord) ||
+        image.size() != sizeof(header) + (header.numOrders + header.numStops) *
+                                             sizeof(SnapshotRecord))
+      throw std::invalid_argument("not a snapshot of this book");
+
+    // room for every record up front, so loading never grows on the way
+    pool_.reserve(header.numOrders);
+    orderIdToIterator_.reserve(header.numOrders);
+    stopIndex_.reserve(header.numStops);
+    const char *in = image.data() + sizeof(header);
+    for (uint64_t i = 0; i < header.numOrders + header.numStops; ++i) {
+      SnapshotRecord record;
+      std::memcpy(&record, in + i * sizeof(record), sizeof(record));
+      if (i >= header.numOrders && record.side == Side::BUY)
+        restoreStop<Side::BUY>(record);
+      else if (i >= header.numOrders)
+        restoreStop<Side::SELL>(record);
+      else if (record.side == Side::BUY)
+        restoreOrder<Side::BUY>(record);
+      else
+        restoreOrder<Side::SELL>(record);
+    }
+    lastPrice_ = static_cast<Price>(header.lastPrice);
+    highPrice_ = lowPrice_ = lastPrice_;
+    hasTraded_ = header.hasTraded != 0;
+    nextOrderId_.store(header.nextOrderId, std::memory_order_relaxed);
   }
 
 private:
-  std::map<Price, Level, std::less<Price>> asks_;
-  std::map<Price, Level, std::greater<Price>> bids_;
-  std::unordered_map<OrderId, Handle> orderIdToIterator_;
+  static const std::size_t defaultNumTicks = 1 << 16;
+
+  template <Side S> using Levels = typename Policy::template Levels<Policy, S>;
+
+  // a stop waiting for its trigger. price is a stop limit's limit
+  struct Stop {
+    OrderType type;
+    Qty qty;
+    Price price;
+    OwnerTag owner;
+  };
+
+  // stops of side S keyed by (trigger, id), in the order a price move
+  // reaches them: lowest trigger first for buys, which fire as it rises,
+  // and highest first for sells. ties go by id, which is arrival order
+  template <Side S> struct StopOrder {
+    bool operator()(const std::pair<Price, OrderId> &a,
+                    const std::pair<Price, OrderId> &b) const {
+      if (a.first != b.first)
+        return S == Side::BUY ? a.first < b.first : a.first > b.first;
+      return a.second < b.second;
+    }
+  };
+  template <Side S>
+  using Stops = std::map<std::pair<Price, OrderId>, Stop, StopOrder<S>>;
+
+  struct StopKey {
+    Side side;
+    Price trigger;
+  };
+
+  template <Side S> Levels<S> &levels() {
+    if constexpr (S == Side::BUY)
+      return bids_;
+    else
+      return asks_;
+  }
+
+  template <Side S> const Levels<S> &levels() const {
+    if constexpr (S == Side::BUY)
+      return bids_;
+    else
+      return asks_;
+  }
+
+  template <typename Levels> void checkPrice(const Levels &own, Price price) {
+    if (price < instrument_.lowTick() || price > instrument_.highTick())
+      throw std::out_of_range("price outside of price band");
+    if (!own.contains(price))
+      throw std::out_of_range("price outside of ladder window");
+  }
+
+  template <Side S> DepthLevel best() const {
+    DepthLevel top{0, 0, 0};
+    levels<S>().visit(1, [&](Price price, const Level &level) {
+      top = DepthLevel{price, level.totalQty, level.orderCount};
+    });
+    return top;
+  }
+
+  template <Side S> std::size_t depthOf(std::span<DepthLevel> out) const {
+    std::size_t count = 0;
+    levels<S>().visit(out.size(), [&](Price price, const Level &level) {
+      out[count++] = DepthLevel{price, level.totalQty, level.orderCount};
+    });
+    return count;
+  }
+
+  // the book is never left crossed, so a new limit order can only trade as
+  // the aggressor. it is matched before it rests, which gives the same trades
+  // as resting it and calling matchOrders, and a non-marketable order skips
+  // matching altogether
+  template <Side S, typename Sink>
+  OrderId addLimit(Price price, Qty qty, Sink &sink, OwnerTag owner) {
+    if (qty == 0)
+      throw std::logic_error("cannot create order with no quantity!");
+    Levels<S> &own = levels<S>();
+    checkPrice(own, price);
+    OrderId id = nextId();
+    placeLimit<S>(id, price, qty, sink, owner);
+    return id;
+  }
+
+  // trades a checked limit order and rests what is left of it
+  template <Side S, typename Sink>
+  void placeLimit(OrderId id, Price price, Qty qty, Sink &sink,
+                  OwnerTag owner) {
+    Levels<S> &own = levels<S>();
+    touchOrder(id);
+    Qty left = take<S, OrderType::LIMIT>(id, price, qty, sink);
+    if (left == 0)
+      return;
+
+    Handler iterator = pool_.allocate(id, S, OrderType::LIMIT, qty, price);
+    pool_[iterator].setRemainingQty(left);
+    pool_[iterator].setOwner(owner);
+    own.at(price).push_back(pool_, iterator);
+    own.activate(price);
+    touch<S>(price);
+    Handle handle{S, price, iterator};
+    orderIdToIterator_.insert(id, handle);
+  }
+
+  // a stop limit's price is checked on entry, so it cannot be refused once
+  // it fires
+  template <Side S, typename Sink>
+  OrderId addStop(OrderType type, Price trigger, Price price, Qty qty,
+                  Sink &sink, OwnerTag owner) {
+    if (qty == 0)
+      throw std::logic_error("cannot create order with no quantity!");
+    checkPrice(levels<S>(), trigger);
+    if (type == OrderType::STOP_LIMIT)
+      checkPrice(levels<S>(), price);
+    OrderId id = nextId();
+    stopIndex_.emplace(id, StopKey{S, trigger});
+    stops<S>().emplace(std::pair{trigger, id}, Stop{type, qty, price, owner});
+    touchOrder(id);
+    triggerStops(sink);
+    return id;
+  }
+
+  template <Side S> Stops<S> &stops() {
+    if constexpr (S == Side::BUY)
+      return buyStops_;
+    else
+      return sellStops_;
+  }
+
+  // whether a trade since the last check has reached trigger, for a stop of
+  // side S. a call can print several prices, and the last of them need not
+  // be the one that went furthest
+  template <Side S> bool triggered(Price trigger) const {
+    if (!hasTraded_)
+      return false;
+    return S == Side::BUY ? highPrice_ >= trigger : lowPrice_ <= trigger;
+  }
+
+  void setLastPrice(Price price) {
+    highPrice_ = hasTraded_ ? std::max(highPrice_, price) : price;
+    lowPrice_ = hasTraded_ ? std::min(lowPrice_, price) : price;
+    lastPrice_ = price;
+    hasTraded_ = true;
+  }
+
+  // enters the stops the trades since the last check have reached, one at a
+  // time, then narrows that range back to the last price. each
+  // side's stops are ordered by how soon a price move reaches them, so only
+  // the front ones are ever looked at, and a fired stop's own trades can
+  // move the price on and fire more. buys go before sells, and among stops
+  // with one trigger the earlier id goes first, so the order is fixed
+  template <typename Sink> void triggerStops(Sink &sink) {
+    while (fireStop<Side::BUY>(sink) || fireStop<Side::SELL>(sink)) {
+    }
+    highPrice_ = lowPrice_ = lastPrice_;
+  }
+
+  template <Side S, typename Sink> bool fireStop(Sink &sink) {
+    Stops<S> &pending = stops<S>();
+    if (pending.empty() || !triggered<S>(pending.begin()->first.first))
+      return false;
+    OrderId id = pending.begin()->first.second;
+    Stop stop = pending.begin()->second;
+    pending.erase(pending.begin());
+    stopIndex_.erase(id);
+    stopsFired_ = true;
+    if (stop.type == OrderType::STOP) {
+      touchOrder(id);
+      take<S, OrderType::MARKET>(id, 0, stop.qty, sink);
+    } else
+      placeLimit<S>(id, stop.price, stop.qty, sink, stop.owner);
+    return true;
+  }
+
+  void cancelStop(OrderId id) {
+    auto it = stopIndex_.find(id);
+    if (it == stopIndex_.end())
+      throw std::out_of_range("unknown order id");
+    auto [side, trigger] = it->second;
+    if (side == Side::BUY)
+      buyStops_.erase({trigger, id});
+    else
+      sellStops_.erase({trigger, id});
+    stopIndex_.erase(it);
+    touchOrder(id);
+  }
+
+  // drops the stops of side S that pred(stop) picks
+  template <Side S, typename Pred> std::size_t cancelStops(Pred pred) {
+    Stops<S> &pending = stops<S>();
+    std::size_t cancelled = 0;
+    for (auto it = pending.begin(); it != pending.end();) {
+      if (!pred(it->second)) {
+        ++it;
+        continue;
+      }
+      stopIndex_.erase(it->first.second);
+      touchOrder(it->first.second);
+      it = pending.erase(it);
+      ++cancelled;
+    }
+    return cancelled;
+  }
+
+  template <Side S> void restoreOrder(const SnapshotRecord &record) {
+    Levels<S> &own = levels<S>();
+    checkPrice(own, record.price);
+    if (record.remainingQty == 0 || record.remainingQty > record.initialQty)
+      throw std::invalid_argument("not a snapshot of this book");
+    Handler iterator = pool_.allocate(record.id, S, OrderType::LIMIT,
+                                      record.initialQty, record.price);
+    pool_[iterator].setRemainingQty(record.remainingQty);
+    pool_[iterator].setOwner(record.owner);
+    own.at(record.price).push_back(pool_, iterator);
+    own.activate(record.price);
+    orderIdToIterator_.insert(record.id, Handle{S, record.price, iterator});
+  }
+
+  template <Side S> void restoreStop(const SnapshotRecord &record) {
+    checkPrice(levels<S>(), record.trigger);
+    if (record.type == OrderType::STOP_LIMIT)
+      checkPrice(levels<S>(), record.price);
+    else if (record.type != OrderType::STOP)
+      throw std::invalid_argument("not a snapshot of this book");
+    if (record.initialQty == 0 ||
+        !stopIndex_.emplace(record.id, StopKey{S, record.trigger}).second)
+      throw std::invalid_argument("not a snapshot of this book");
+    stops<S>().emplace(
+        std::pair{record.trigger, record.id},
+        Stop{record.type, record.initialQty, record.price, record.owner});
+  }
+
+  // an IOC trades like a limit order and drops what is left; a FOK first
+  // checks the cached level totals up to its price and is killed untouched
+  // unless they cover it. either way nothing is allocated or indexed
+  template <Side S, OrderType T, typename Sink>
+  OrderId addImmediate(Price price, Qty qty, Sink &sink) {
+    if (qty == 0)
+      throw std::logic_error("cannot create order with no quantity!");
+    checkPrice(levels<S>(), price);
+    OrderId id = nextId();
+    touchOrder(id);
+    if (T == OrderType::FOK && !canFill<S>(price, qty))
+      return id;
+    take<S, T>(id, price, qty, sink);
+    return id;
+  }
+
+  // whether an order of side S could trade qty at price or better
+  template <Side S> bool canFill(Price price, Qty qty) const {
+    Qty available = 0;
+    levels<opposite(S)>().visit(
+        std::numeric_limits<std::size_t>::max(),
+        [&](Price level, const Level &resting) {
+          if (S == Side::BUY ? level > price : level < price)
+            return false;
+          if (resting.totalQty >= qty - available) {
+            available = qty;
+            return false;
+          }
+          available += resting.totalQty;
+          return true;
+        });
+    return available == qty;
+  }
+
+  template <Side S, typename Sink> OrderId addMarket(Qty qty, Sink &sink) {
+    if (qty == 0)
+      return 0;
+
+    OrderId marketId = nextId(); // synthetic id for the market order
+    touchOrder(marketId);
+    take<S, OrderType::MARKET>(marketId, 0, qty, sink);
+    return marketId;
+  }
+
+  // trades an incoming order of side S against the opposite side, best level
+  // first, until qty runs out or, for a priced order, the opposite side no
+  // longer crosses price. a buy consumes asks, a sell consumes bids. the
+  // incoming side of each trade is priced at its limit, or at the level for a
+  // market order. returns the quantity left
+  template <Side S, OrderType T, typename Sink>
+  Qty take(OrderId id, Price price, Qty qty, Sink &sink) {
+    Levels<opposite(S)> &opp = levels<opposite(S)>();
+
+    while (qty > 0 && !opp.empty()) {
+      Price best = opp.bestPrice();
+      if constexpr (T != OrderType::MARKET) {
+        if (S == Side::BUY ? best > price : best < price)
+          break;
+      }
+      Price own = T == OrderType::MARKET ? best : price;
+      Level &level = opp.bestLevel();
+      touch<opposite(S)>(best);
+      countStat(StatCounter::LEVELS_TOUCHED);
+
+      // a level the order wipes out is taken whole: every resting order
+      // fills completely, so there is no queue to maintain while walking it,
+      // and the orders go back to the pool as one chain
+      if (level.totalQty <= qty) {
+        for (OrderIndex index = level.head; index != nullOrder;) {
+          auto &&resting = pool_[index];
+          report<S>(sink, id, own, resting.getOrderId(), best,
+                    resting.getRemainingQty());
+          orderIdToIterator_.erase(resting.getOrderId());
+          index = resting.getNext();
+        }
+        qty -= level.totalQty;
+        pool_.release(level.head, level.tail, level.orderCount);
+        opp.erase(best);
+        continue;
+      }
+
+      // the last level is only partly taken
+      while (qty > 0) {
+        OrderIndex index = level.head;
+        auto &&resting = pool_[index];
+        Qty exec = std::min(qty, resting.getRemainingQty());
+
+        OrderId restingId = resting.getOrderId();
+        report<S>(sink, id, own, restingId, best, exec);
+        level.fill(resting, exec);
+        qty -= exec;
+
+        if (resting.isFilled()) {
+          level.pop_front(pool_);
+          orderIdToIterator_.erase(restingId);
+          pool_.release(index);
+        }
+      }
+    }
+    return qty;
+  }
+
+  // reports one execution of an incoming order of side S
+  template <Side S, typename Sink>
+  void report(Sink &sink, OrderId id, Price price, OrderId restingId,
+              Price restingPrice, Qty exec) {
+    countStat(StatCounter::TRADES);
+    setLastPrice(restingPrice);
+    touchOrder(restingId);
+    if constexpr (S == Side::BUY) {
+      sink(Trade{TradeInfo{id, price, exec},                  // buy
+                 TradeInfo{restingId, restingPrice, exec}}); // sell
+    } else {
+      sink(Trade{TradeInfo{restingId, restingPrice, exec}, // buy
+                 TradeInfo{id, price, exec}});              // sell
+    }
+  }
+
+  template <Side S> void resize(const Handle &handle, Qty qty) {
+    Level &level = levels<S>().at(handle.price);
+    auto &&order = pool_[handle.it];
+    Qty remaining = order.getRemainingQty();
+    if (qty <= remaining) {
+      level.reduce(order, remaining - qty);
+    } else {
+      level.erase(pool_, handle.it);
+      order.setInitialQty(order.getInitialQty() + (qty - remaining));
+      order.setRemainingQty(qty);
+      level.push_back(pool_, handle.it);
+    }
+    touch<S>(handle.price);
+  }
+
+  template <Side S, typename Sink>
+  void move(OrderId id, const Handle &handle, Price price, Qty qty,
+            Sink &sink) {
+    Levels<S> &own = levels<S>();
+    checkPrice(own, price);
+    unlink<S>(handle.price, handle.it);
+    touchOrder(id);
+    Qty left = take<S, OrderType::LIMIT>(id, price, qty, sink);
+    if (left == 0) {
+      orderIdToIterator_.erase(id);
+      pool_.release(handle.it);
+      return;
+    }
+
+    auto &&order = pool_[handle.it];
+    order.setPrice(price);
+    order.setInitialQty(qty);
+    order.setRemainingQty(left);
+    own.at(price).push_back(pool_, handle.it);
+    own.activate(price);
+    touch<S>(price);
+    orderIdToIterator_.at(id).price = price;
+  }
+
+  template <Side S> std::size_t cancelRange(Price low, Price high) {
+    Levels<S> &own = levels<S>();
+    std::vector<Price> prices;
+    own.collect(low, high, prices);
+    std::size_t cancelled = 0;
+    for (Price price : prices) {
+      cancelled += dropLevel<S>(price);
+      touch<S>(price);
+    }
+    return cancelled;
+  }
+
+  template <Side S> std::size_t cancelOwner(OwnerTag owner) {
+    Levels<S> &own = levels<S>();
+    std::vector<Price> prices;
+    own.collect(std::numeric_limits<Price>::min(),
+                std::numeric_limits<Price>::max(), prices);
+    std::size_t cancelled = 0;
+    for (Price price : prices) {
+      Level &level = own.at(price);
+      uint32_t count = 0;
+      for (OrderIndex i = level.head; i != nullOrder; i = pool_[i].getNext())
+        count += pool_[i].getOwner() == owner;
+      if (count == 0)
+        continue;
+      touch<S>(price);
+      if (count == level.orderCount) {
+        cancelled += dropLevel<S>(price);
+        continue;
+      }
+      for (OrderIndex i = level.head; i != nullOrder;) {
+        OrderIndex next = pool_[i].getNext();
+        if (pool_[i].getOwner() == owner) {
+          orderIdToIterator_.erase(pool_[i].getOrderId());
+          touchOrder(pool_[i].getOrderId());
+          level.erase(pool_, i);
+          pool_.release(i);
+        }
+        i = next;
+      }
+      cancelled += count;
+    }
+    return cancelled;
+  }
+
+  // cancels every order at price and clears the level
+  template <Side S> std::size_t dropLevel(Price price) {
+    Levels<S> &own = levels<S>();
+    Level &level = own.at(price);
+    std::size_t count = level.orderCount;
+    for (OrderIndex i = level.head; i != nullOrder; i = pool_[i].getNext()) {
+      orderIdToIterator_.erase(pool_[i].getOrderId());
+      touchOrder(pool_[i].getOrderId());
+    }
+    pool_.release(level.head, level.tail, count);
+    own.erase(price);
+    return count;
+  }
+
+  template <Side S> void unlink(Price price, OrderIndex index) {
+    Levels<S> &own = levels<S>();
+    Level &level = own.at(price);
+    level.erase(pool_, index);
+    touch<S>(price);
+    if (level.empty())
+      own.erase(price);
+  }
+
+  // notes a changed level for the next publishDeltas(). a call walks each
+  // side's levels in price order, so repeats are adjacent unless stops fired
+  // on the way, which publishDeltas() then sorts out
+  template <Side S> void touch(Price price) {
+    if (!deltaHook_)
+      return;
+    std::vector<Price> &dirty = S == Side::BUY ? dirtyBids_ : dirtyAsks_;
+    if (dirty.empty() || dirty.back() != price)
+      dirty.push_back(price);
+  }
+
+  // notes a changed order for the next publishDeltas()
+  void touchOrder(OrderId id) {
+    if (orderHook_)
+      dirtyOrders_.push_back(id);
+  }
+
+  // feeds the level deltas and then the order states of the call
+  void publishDeltas() {
+    publishLevels();
+    if (!orderHook_ || dirtyOrders_.empty())
+      return;
+    changedOrders_.clear();
+    for (OrderId id : dirtyOrders_)
+      changedOrders_.push_back(order_state(id));
+    dirtyOrders_.clear();
+    orderHook_(changedOrders_);
+  }
+
+  void publishLevels() {
+    if (!deltaHook_)
+      return;
+    for (Side side : {Side::BUY, Side::SELL}) {
+      std::vector<Price> &dirty = side == Side::BUY ? dirtyBids_ : dirtyAsks_;
+      if (stopsFired_) {
+        std::sort(dirty.begin(), dirty.end());
+        dirty.erase(std::unique(dirty.begin(), dirty.end()), dirty.end());
+      }
+      for (Price price : dirty) {
+        DepthLevel level = level_at(side, price);
+        deltaHook_(LevelDelta{side, price, level.qty, level.orders});
+      }
+      dirty.clear();
+    }
+    stopsFired_ = false;
+  }
+
+  Levels<Side::SELL> asks_;
+  Levels<Side::BUY> bids_;
+  typename Policy::template IdIndex<Policy> orderIdToIterator_;
   std::atomic<OrderId> nextOrderId_{1};
   OrderPool pool_;
+  DeltaHook deltaHook_;
+  std::vector<Price> dirtyBids_;
+  std::vector<Price> dirtyAsks_;
+  OrderHook orderHook_;
+  std::vector<OrderId> dirtyOrders_;
+  std::vector<OrderState> changedOrders_;
+  Instrument instrument_;
+  Stops<Side::BUY> buyStops_;
+  Stops<Side::SELL> sellStops_;
+  std::unordered_map<OrderId, StopKey> stopIndex_;
+  Price lastPrice_{};
+  // highest and lowest trade since stops were last checked
+  Price highPrice_{};
+  Price lowPrice_{};
+  bool hasTraded_ = false;
+  bool stopsFired_ = false;
 };
+
+using OrderId = DefaultPolicy::OrderId;
+using Price = DefaultPolicy::Price;
+using Qty = DefaultPolicy::Qty;
+using Order = BasicOrder<DefaultPolicy>;
+using OrderPool = BasicOrderPool<DefaultPolicy>;
+using TradeInfo = BasicTradeInfo<DefaultPolicy>;
+using Trade = BasicTrade<DefaultPolicy>;
+using Trades = std::vector<Trade>;
+using Level = BasicLevel<DefaultPolicy>;
+using Handle = BasicHandle<DefaultPolicy>;
+using IdIndex = DirectIdIndex<DefaultPolicy>;
+using Command = BasicCommand<DefaultPolicy>;
+using DepthLevel = BasicDepthLevel<DefaultPolicy>;
+using TopOfBook = BasicTopOfBook<DefaultPolicy>;
+using BookDepth = BasicBookDepth<DefaultPolicy>;
+using LevelDelta = BasicLevelDelta<DefaultPolicy>;
+using SnapshotRecord = BasicSnapshotRecord<DefaultPolicy>;
+using Instrument = BasicInstrument<DefaultPolicy>;
+using OrderBook = BasicOrderBook<DefaultPolicy>;
@@ -0,0 +1,34 @@
+// rebuilds a book from a journal written by Journal.cpp and reports how long
+// that took. build with optimizations:
+//
+//   g++ -std=c++20 -O3 -march=native -DNDEBUG Replay.cpp -o replay
+//   ./replay orders.journal
+
+#include "Journal.cpp"
+
+#include <chrono>
+#include <cstdio>
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    std::fprintf(stderr, "usage: %s journal\n", argv[0]);
+    return 2;
+  }
+  using Clock = std::chrono::steady_clock;
+  auto book = std::make_unique<OrderBook>();
+  uint64_t trades = 0;
+  auto begin = Clock::now();
+  std::size_t records =
+      replayJournal(argv[1], *book, [&](const Trade &) { ++trades; });
+  double seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+
+  TopOfBook top = book->top_of_book();
+  std::printf("%zu records, %lu trades in %.3fs (%.2f M records/s)\n", records,
+              trades, seconds, records / seconds / 1e6);
+  std::printf("best bid %u x %u, best ask %u x %u\n", top.bid.price,
+              top.bid.qty, top.ask.price, top.ask.qty);
+  MemoryStats memory = book->memory_stats();
+  std::printf("pool %zu orders, high water %zu, %lu refills, %lu index grows\n",
+              memory.poolCapacity, memory.ordersHighWater, memory.poolRefills,
+              memory.indexGrows);
+}
@@ -0,0 +1,192 @@
+#pragma once
+
+#include "OrderBookOptimized.cpp"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// pins the calling thread to one cpu. a no-op off linux
+inline void pinThread(int cpu) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+// lock-free ring between exactly one producer thread and one consumer thread.
+// each side keeps a cached copy of the other side's index so it only touches
+// the other side's cache line when the ring looks full or empty
+template <typename T> class SpscRing {
+public:
+  explicit SpscRing(std::size_t capacity)
+      : slots_(std::bit_ceil(capacity)), mask_{slots_.size() - 1} {}
+
+  bool try_push(const T &value) {
+    std::size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - headCache_ == slots_.size()) {
+      headCache_ = head_.load(std::memory_order_acquire);
+      if (tail - headCache_ == slots_.size())
+        return false;
+    }
+    slots_[tail & mask_] = value;
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool try_pop(T &value) {
+    std::size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tailCache_) {
+      tailCache_ = tail_.load(std::memory_order_acquire);
+      if (head == tailCache_)
+        return false;
+    }
+    value = slots_[head & mask_];
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+private:
+  std::vector<T> slots_;
+  std::size_t mask_;
+  // consumer side
+  alignas(64) std::atomic<std::size_t> head_{0};
+  std::size_t tailCache_{0};
+  // producer side
+  alignas(64) std::atomic<std::size_t> tail_{0};
+  std::size_t headCache_{0};
+};
+
+enum class EventType { ACCEPTED, CANCELLED, TRADE, REJECTED };
+
+// what the matching thread publishes for each command: ACCEPTED (with the
+// book's id for the order), CANCELLED or REJECTED, followed by one TRADE per
+// execution. seq is the position of the command in the sequenced stream and
+// tag echoes the producer's own correlation id. last is set on the final
+// event of a command, so a consumer knows when its results are complete
+template <typename Book> struct BasicEvent {
+  EventType type;
+  uint64_t seq;
+  uint64_t tag;
+  typename Book::OrderId id;
+  typename Book::TradeInfo buy;
+  typename Book::TradeInfo sell;
+  bool last;
+};
+
+// single-threaded matching front end. each producer thread owns one ingress
+// ring, and one matching thread drains the rings round-robin into the book,
+// so commands are applied in a single deterministic order with no locks.
+// results go out on one outbound ring for a single consumer. while the
+// matching thread runs, nothing else may touch the book
+template <typename Book = OrderBook> class Sequencer {
+public:
+  using Command = typename Book::Command;
+  using Event = BasicEvent<Book>;
+
+  struct Request {
+    Command command;
+    uint64_t tag;
+  };
+
+  Sequencer(Book &book, std::size_t numProducers,
+            std::size_t ringCapacity = defaultRingCapacity)
+      : book_{book}, ingress_{}, outbound_{ringCapacity}, trades_{} {
+    for (std::size_t i = 0; i < numProducers; ++i)
+      ingress_.push_back(std::make_unique<SpscRing<Request>>(ringCapacity));
+  }
+
+  ~Sequencer() { stop(); }
+
+  // producer side: only the thread that owns `producer` may call this. returns
+  // false if that producer's ring is full
+  bool submit(std::size_t producer, const Command &command, uint64_t tag = 0) {
+    return ingress_[producer]->try_push(Request{command, tag});
+  }
+
+  // consumer side of the outbound ring
+  bool poll(Event &event) { return outbound_.try_pop(event); }
+
+  // starts the matching thread, pinned to cpu when cpu >= 0
+  void start(int cpu = -1) {
+    running_.store(true, std::memory_order_release);
+    thread_ = std::thread([this, cpu] {
+      if (cpu >= 0)
+        pinThread(cpu);
+      while (running_.load(std::memory_order_acquire)) {
+        if (drain() == 0) {
+          book_.maintain();
+          std::this_thread::yield();
+        }
+      }
+      while (drain() != 0) {
+      }
+    });
+  }
+
+  // stops the matching thread once the rings are drained
+  void stop() {
+    running_.store(false, std::memory_order_release);
+    if (thread_.joinable())
+      thread_.join();
+  }
+
+  // one round-robin pass over the ingress rings, applying at most one command
+  // per producer. returns how many commands were applied. called by the
+  // matching thread, or directly by a caller that drives the sequencer itself
+  std::size_t drain() {
+    std::size_t applied = 0;
+    Request request;
+    for (auto &ring : ingress_) {
+      if (!ring->try_pop(request))
+        continue;
+      apply(request);
+      ++applied;
+    }
+    return applied;
+  }
+
+private:
+  static const std::size_t defaultRingCapacity = 1 << 16;
+
+  void apply(const Request &request) {
+    uint64_t seq = nextSeq_++;
+    trades_.clear();
+    try {
+      auto id = book_.execute(request.command, AppendTrades{trades_});
+      EventType type = request.command.type == CommandType::CANCEL
+                           ? EventType::CANCELLED
+                           : EventType::ACCEPTED;
+      publish(Event{type, seq, request.tag, id, {}, {}, trades_.empty()});
+    } catch (const std::exception &) {
+      publish(Event{EventType::REJECTED, seq, request.tag, 0, {}, {},
+                    trades_.empty()});
+    }
+    for (std::size_t i = 0; i < trades_.size(); ++i)
+      publish(Event{EventType::TRADE, seq, request.tag, 0, trades_[i].getBuy(),
+                    trades_[i].getSell(), i + 1 == trades_.size()});
+  }
+
+  // the matching thread waits for the consumer rather than drop results
+  void publish(const Event &event) {
+    while (!outbound_.try_push(event))
+      std::this_thread::yield();
+  }
+
+  Book &book_;
+  std::vector<std::unique_ptr<SpscRing<Request>>> ingress_;
+  SpscRing<Event> outbound_;
+  typename Book::Trades trades_;
+  uint64_t nextSeq_{0};
+  std::atomic<bool> running_{false};
+  std::thread thread_;
+};
@@ -0,0 +1,226 @@
+#pragma once
+
+// hot-path instrumentation for the optimized book, compiled in only with
+// -DORDERBOOK_STATS. without it OpTimer and countStat are empty inlines and
+// the book is built exactly as before.
+//
+// every thread that runs the book records into its own ThreadStats: cycle
+// histograms per operation and event counters. each is written by that one
+// thread with plain relaxed stores and read by anyone with relaxed loads, so
+// dumpStats() can run on a monitoring thread while matching goes on
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <iomanip>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+#if defined(ORDERBOOK_STATS) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#elif defined(ORDERBOOK_STATS)
+#include <chrono>
+#endif
+
+enum class StatOp {
+  ADD_LIMIT,
+  ADD_MARKET,
+  ADD_IOC,
+  ADD_FOK,
+  ADD_STOP,
+  CANCEL,
+  MODIFY,
+  REPLACE,
+  MASS_CANCEL,
+  MATCH,
+  ALLOCATE,
+  COUNT
+};
+
+// LEVELS_TOUCHED counts the price levels orders traded against, TRADES the
+// executions reported and POOL_REFILLS the times an empty order pool had to
+// be refilled while matching
+enum class StatCounter { LEVELS_TOUCHED, TRADES, POOL_REFILLS, COUNT };
+
+#ifdef ORDERBOOK_STATS
+
+// time stamp counter, or nanoseconds where there is none
+inline uint64_t readCycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+// adds to a value only its owning thread writes, without a locked RMW
+inline void bump(std::atomic<uint64_t> &value, uint64_t n) {
+  value.store(value.load(std::memory_order_relaxed) + n,
+              std::memory_order_relaxed);
+}
+
+// log-linear histogram of cycle counts: every power of two is split into
+// 2^subBits buckets, so a reported value is within 1/2^subBits of the true
+// one. single writer, any number of readers
+class CycleHistogram {
+public:
+  void record(uint64_t cycles) {
+    bump(counts_[index(cycles)], 1);
+    if (cycles > max_.load(std::memory_order_relaxed))
+      max_.store(cycles, std::memory_order_relaxed);
+  }
+
+  uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+
+  // merges this histogram into a plain copy of its buckets
+  void addTo(std::vector<uint64_t> &counts, uint64_t &max) const {
+    counts.resize(numBuckets);
+    for (std::size_t i = 0; i < numBuckets; ++i)
+      counts[i] += counts_[i].load(std::memory_order_relaxed);
+    max = std::max(max, this->max());
+  }
+
+  static uint64_t lowest(std::size_t index) {
+    if (index < sub)
+      return index;
+    std::size_t shift = index / sub - 1;
+    return (sub + index % sub) << shift;
+  }
+
+private:
+  static const int subBits = 3;
+  static const uint64_t sub = uint64_t{1} << subBits;
+  static const std::size_t numBuckets = 65 * sub;
+
+  static std::size_t index(uint64_t value) {
+    if (value < sub)
+      return value;
+    int shift = std::bit_width(value) - 1 - subBits;
+    return (shift + 1) * sub + ((value >> shift) - sub);
+  }
+
+  std::atomic<uint64_t> counts_[numBuckets]{};
+  std::atomic<uint64_t> max_{0};
+};
+
+struct ThreadStats {
+  CycleHistogram ops[static_cast<std::size_t>(StatOp::COUNT)];
+  std::atomic<uint64_t>
+      counters[static_cast<std::size_t>(StatCounter::COUNT)]{};
+};
+
+// every ThreadStats ever created. entries outlive their threads, so a dump
+// still covers the work of threads that have exited
+class StatsRegistry {
+public:
+  static StatsRegistry &instance() {
+    static StatsRegistry registry;
+    return registry;
+  }
+
+  std::shared_ptr<ThreadStats> add() {
+    auto stats = std::make_shared<ThreadStats>();
+    std::lock_guard<std::mutex> lock(mutex_);
+    threads_.push_back(stats);
+    return stats;
+  }
+
+  std::vector<std::shared_ptr<ThreadStats>> threads() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return threads_;
+  }
+
+private:
+  std::mutex mutex_;
+  std::vector<std::shared_ptr<ThreadStats>> threads_;
+};
+
+inline ThreadStats &threadStats() {
+  thread_local std::shared_ptr<ThreadStats> stats =
+      StatsRegistry::instance().add();
+  return *stats;
+}
+
+// times one operation from construction to destruction
+class OpTimer {
+public:
+  explicit OpTimer(StatOp op) : op_{op}, start_{readCycles()} {}
+  ~OpTimer() {
+    threadStats().ops[static_cast<std::size_t>(op_)].record(readCycles() -
+                                                            start_);
+  }
+
+  OpTimer(const OpTimer &) = delete;
+  OpTimer &operator=(const OpTimer &) = delete;
+
+private:
+  StatOp op_;
+  uint64_t start_;
+};
+
+inline void countStat(StatCounter counter, uint64_t n = 1) {
+  bump(threadStats().counters[static_cast<std::size_t>(counter)], n);
+}
+
+// writes the stats of all threads merged: per operation the count and cycle
+// percentiles, then the counters
+inline void dumpStats(std::ostream &out) {
+  static const char *opNames[] = {
+      "add_limit", "add_market", "add_ioc",     "add_fok", "add_stop",
+      "cancel",    "modify",     "replace",     "mass_cancel",
+      "match",     "allocate"};
+  static const char *counterNames[] = {"levels touched", "trades",
+                                       "pool refills"};
+  auto threads = StatsRegistry::instance().threads();
+
+  out << std::left << std::setw(11) << "op" << std::right << std::setw(11)
+      << "count" << std::setw(9) << "p50" << std::setw(9) << "p99"
+      << std::setw(9) << "p99.9" << std::setw(11) << "max"
+      << "  (cycles)\n";
+  for (std::size_t op = 0; op < std::size(opNames); ++op) {
+    std::vector<uint64_t> counts;
+    uint64_t max = 0;
+    for (auto &stats : threads)
+      stats->ops[op].addTo(counts, max);
+    uint64_t total = 0;
+    for (uint64_t count : counts)
+      total += count;
+    auto percentile = [&](double p) {
+      uint64_t rank = static_cast<uint64_t>(p / 100.0 * total + 0.5);
+      uint64_t seen = 0;
+      for (std::size_t i = 0; i < counts.size(); ++i) {
+        seen += counts[i];
+        if (seen >= rank && seen > 0)
+          return std::min(CycleHistogram::lowest(i), max);
+      }
+      return max;
+    };
+    out << std::left << std::setw(11) << opNames[op] << std::right
+        << std::setw(11) << total << std::setw(9) << percentile(50)
+        << std::setw(9) << percentile(99) << std::setw(9) << percentile(99.9)
+        << std::setw(11) << max << "\n";
+  }
+  for (std::size_t counter = 0; counter < std::size(counterNames); ++counter) {
+    uint64_t total = 0;
+    for (auto &stats : threads)
+      total += stats->counters[counter].load(std::memory_order_relaxed);
+    out << counterNames[counter] << ": " << total << "\n";
+  }
+}
+
+#else
+
+class OpTimer {
+public:
+  explicit OpTimer(StatOp) {}
+};
+
+inline void countStat(StatCounter, uint64_t = 1) {}
+
+inline void dumpStats(std::ostream &) {}
+
+#endif
@@ -0,0 +1,311 @@
+#pragma once
+
+// fixed-layout binary messages between the book and the wire, in the manner
+// of SBE. a message is an 8-byte header (body length, template id, schema
+// id, schema version) followed by a body of little-endian fields at fixed
+// offsets. decoders are views that read fields in place from a receive
+// buffer and encoders write them straight into a send buffer, so nothing
+// sits between the wire bytes and the book: a COMMAND is turned into the
+// book's own Command, and trades are encoded as EXECUTIONs from inside the
+// book's sink
+//
+//   COMMAND    (48)  type u8, side u8, -, owner u32, price u64, qty u64,
+//                    id u64, clientTag u64, stopPrice u64
+//   ACK        (32)  status u8, -, clientTag u64, id u64, trades u32, -
+//   EXECUTION  (48)  buyId u64, buyPrice u64, sellId u64, sellPrice u64,
+//                    qty u64, clientTag u64
+//
+// a body longer than its template's is a newer version of it: the known
+// fields are read and the rest skipped
+
+#include "OrderBookOptimized.cpp"
+
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <span>
+#include <stdexcept>
+#include <vector>
+
+static_assert(std::endian::native == std::endian::little,
+              "wire fields are stored in native byte order");
+
+inline constexpr uint16_t wireSchemaId = 1;
+inline constexpr uint16_t wireSchemaVersion = 2;
+inline constexpr std::size_t wireHeaderLength = 8;
+
+enum class WireTemplate : uint16_t { COMMAND = 1, ACK = 2, EXECUTION = 3 };
+
+// what a COMMAND came to
+enum class WireStatus : uint8_t { ACCEPTED, CANCELLED, REJECTED };
+
+template <typename T> T wireLoad(const char *at) {
+  T value;
+  std::memcpy(&value, at, sizeof(value));
+  return value;
+}
+
+template <typename T> void wireStore(char *at, T value) {
+  std::memcpy(at, &value, sizeof(value));
+}
+
+inline void wireHeader(char *message, WireTemplate id, uint16_t bodyLength) {
+  wireStore<uint16_t>(message, bodyLength);
+  wireStore<uint16_t>(message + 2, static_cast<uint16_t>(id));
+  wireStore<uint16_t>(message + 4, wireSchemaId);
+  wireStore<uint16_t>(message + 6, wireSchemaVersion);
+}
+
+class CommandDecoder {
+public:
+  static constexpr uint16_t bodyLength = 48;
+
+  explicit CommandDecoder(const char *message)
+      : body_{message + wireHeaderLength} {}
+
+  CommandType type() const {
+    return static_cast<CommandType>(wireLoad<uint8_t>(body_));
+  }
+  Side side() const { return static_cast<Side>(wireLoad<uint8_t>(body_ + 1)); }
+  OwnerTag owner() const { return wireLoad<uint32_t>(body_ + 4); }
+  uint64_t price() const { return wireLoad<uint64_t>(body_ + 8); }
+  uint64_t qty() const { return wireLoad<uint64_t>(body_ + 16); }
+  uint64_t id() const { return wireLoad<uint64_t>(body_ + 24); }
+  uint64_t clientTag() const { return wireLoad<uint64_t>(body_ + 32); }
+  uint64_t stopPrice() const { return wireLoad<uint64_t>(body_ + 40); }
+
+  // the book Command this message carries. an unknown type or side is
+  // refused, as is a price or quantity too wide for the book rather than
+  // truncated
+  template <typename Command> Command command() const {
+    using Price = decltype(Command::price);
+    using Qty = decltype(Command::qty);
+    if (!knownCommand(wireLoad<uint8_t>(body_), wireLoad<uint8_t>(body_ + 1)))
+      throw std::invalid_argument("unknown command type or side");
+    if (price() > std::numeric_limits<Price>::max() ||
+        qty() > std::numeric_limits<Qty>::max() ||
+        stopPrice() > std::numeric_limits<Price>::max())
+      throw std::out_of_range("field too wide for this book");
+    return {type(),
+            side(),
+            static_cast<Price>(price()),
+            static_cast<Qty>(qty()),
+            static_cast<decltype(Command::id)>(id()),
+            owner(),
+            static_cast<Price>(stopPrice())};
+  }
+
+private:
+  const char *body_;
+};
+
+class CommandEncoder {
+public:
+  static constexpr std::size_t length =
+      wireHeaderLength + CommandDecoder::bodyLength;
+
+  explicit CommandEncoder(char *message) : body_{message + wireHeaderLength} {
+    wireHeader(message, WireTemplate::COMMAND, CommandDecoder::bodyLength);
+    std::memset(body_, 0, CommandDecoder::bodyLength);
+  }
+
+  CommandEncoder &type(CommandType type) {
+    wireStore<uint8_t>(body_, static_cast<uint8_t>(type));
+    return *this;
+  }
+  CommandEncoder &side(Side side) {
+    wireStore<uint8_t>(body_ + 1, static_cast<uint8_t>(side));
+    return *this;
+  }
+  CommandEncoder &owner(OwnerTag owner) {
+    wireStore<uint32_t>(body_ + 4, owner);
+    return *this;
+  }
+  CommandEncoder &price(uint64_t price) {
+    wireStore<uint64_t>(body_ + 8, price);
+    return *this;
+  }
+  CommandEncoder &qty(uint64_t qty) {
+    wireStore<uint64_t>(body_ + 16, qty);
+    return *this;
+  }
+  CommandEncoder &id(uint64_t id) {
+    wireStore<uint64_t>(body_ + 24, id);
+    return *this;
+  }
+  CommandEncoder &clientTag(uint64_t tag) {
+    wireStore<uint64_t>(body_ + 32, tag);
+    return *this;
+  }
+  CommandEncoder &stopPrice(uint64_t price) {
+    wireStore<uint64_t>(body_ + 40, price);
+    return *this;
+  }
+
+private:
+  char *body_;
+};
+
+class AckDecoder {
+public:
+  static constexpr uint16_t bodyLength = 32;
+
+  explicit AckDecoder(const char *message)
+      : body_{message + wireHeaderLength} {}
+
+  WireStatus status() const {
+    return static_cast<WireStatus>(wireLoad<uint8_t>(body_));
+  }
+  uint64_t clientTag() const { return wireLoad<uint64_t>(body_ + 8); }
+  uint64_t id() const { return wireLoad<uint64_t>(body_ + 16); }
+  uint32_t trades() const { return wireLoad<uint32_t>(body_ + 24); }
+
+private:
+  const char *body_;
+};
+
+// writes a whole ACK at message
+inline void encodeAck(char *message, WireStatus status, uint64_t clientTag,
+                      uint64_t id, uint32_t trades) {
+  wireHeader(message, WireTemplate::ACK, AckDecoder::bodyLength);
+  char *body = message + wireHeaderLength;
+  std::memset(body, 0, AckDecoder::bodyLength);
+  wireStore<uint8_t>(body, static_cast<uint8_t>(status));
+  wireStore<uint64_t>(body + 8, clientTag);
+  wireStore<uint64_t>(body + 16, id);
+  wireStore<uint32_t>(body + 24, trades);
+}
+
+class ExecutionDecoder {
+public:
+  static constexpr uint16_t bodyLength = 48;
+
+  explicit ExecutionDecoder(const char *message)
+      : body_{message + wireHeaderLength} {}
+
+  uint64_t buyId() const { return wireLoad<uint64_t>(body_); }
+  uint64_t buyPrice() const { return wireLoad<uint64_t>(body_ + 8); }
+  uint64_t sellId() const { return wireLoad<uint64_t>(body_ + 16); }
+  uint64_t sellPrice() const { return wireLoad<uint64_t>(body_ + 24); }
+  uint64_t qty() const { return wireLoad<uint64_t>(body_ + 32); }
+  uint64_t clientTag() const { return wireLoad<uint64_t>(body_ + 40); }
+
+private:
+  const char *body_;
+};
+
+// writes a whole EXECUTION for trade at message
+template <typename Trade>
+void encodeExecution(char *message, const Trade &trade, uint64_t clientTag) {
+  wireHeader(message, WireTemplate::EXECUTION, ExecutionDecoder::bodyLength);
+  char *body = message + wireHeaderLength;
+  const auto &buy = trade.getBuy();
+  const auto &sell = trade.getSell();
+  wireStore<uint64_t>(body, buy.id_);
+  wireStore<uint64_t>(body + 8, buy.price_);
+  wireStore<uint64_t>(body + 16, sell.id_);
+  wireStore<uint64_t>(body + 24, sell.price_);
+  wireStore<uint64_t>(body + 32, buy.qty_);
+  wireStore<uint64_t>(body + 40, clientTag);
+}
+
+// contiguous bytes that messages are encoded into and then sent whole. it
+// grows if a burst outruns it; sizing it for the largest burst keeps that
+// off the matching path
+class SendBuffer {
+public:
+  explicit SendBuffer(std::size_t capacity = 1 << 16)
+      : bytes_(capacity), size_{0} {}
+
+  // n bytes at the end of the buffer for the caller to encode into
+  char *claim(std::size_t n) {
+    if (bytes_.size() - size_ < n)
+      bytes_.resize(std::max(bytes_.size() * 2, size_ + n));
+    char *at = bytes_.data() + size_;
+    size_ += n;
+    return at;
+  }
+
+  std::span<const char> data() const { return {bytes_.data(), size_}; }
+  void clear() { size_ = 0; }
+
+private:
+  std::vector<char> bytes_;
+  std::size_t size_;
+};
+
+// book sink that encodes each trade as an EXECUTION at the end of out
+struct ExecutionWriter {
+  SendBuffer &out;
+  uint64_t clientTag;
+  uint32_t count = 0;
+
+  template <typename Trade> void operator()(const Trade &trade) {
+    encodeExecution(out.claim(wireHeaderLength + ExecutionDecoder::bodyLength),
+                    trade, clientTag);
+    ++count;
+  }
+};
+
+// body length of a template at this version, 0 for an unknown one
+inline uint16_t wireBodyLength(WireTemplate id) {
+  switch (id) {
+  case WireTemplate::COMMAND:
+    return CommandDecoder::bodyLength;
+  case WireTemplate::ACK:
+    return AckDecoder::bodyLength;
+  case WireTemplate::EXECUTION:
+    return ExecutionDecoder::bodyLength;
+  }
+  return 0;
+}
+
+// calls fn(template, message) for every whole message at the start of in
+// and returns the bytes they take up; a partial message at the end is left
+// for the next call. a header of another schema, or a body shorter than its
+// template's, means the stream is not this protocol
+template <typename Fn>
+std::size_t forEachMessage(std::span<const char> in, Fn &&fn) {
+  std::size_t used = 0;
+  while (in.size() - used >= wireHeaderLength) {
+    const char *message = in.data() + used;
+    uint16_t bodyLength = wireLoad<uint16_t>(message);
+    auto id = static_cast<WireTemplate>(wireLoad<uint16_t>(message + 2));
+    uint16_t minLength = wireBodyLength(id);
+    if (wireLoad<uint16_t>(message + 4) != wireSchemaId ||
+        wireLoad<uint16_t>(message + 6) < wireSchemaVersion ||
+        minLength == 0 || bodyLength < minLength)
+      throw std::invalid_argument("not a message of this schema");
+    if (in.size() - used < wireHeaderLength + bodyLength)
+      break;
+    fn(id, message);
+    used += wireHeaderLength + bodyLength;
+  }
+  return used;
+}
+
+// applies every whole COMMAND at the start of in to book, writing each
+// one's EXECUTIONs and then its ACK to out. returns the bytes consumed
+template <typename Book>
+std::size_t executeMessages(Book &book, std::span<const char> in,
+                            SendBuffer &out) {
+  return forEachMessage(in, [&](WireTemplate id, const char *message) {
+    if (id != WireTemplate::COMMAND)
+      return;
+    CommandDecoder decoder{message};
+    ExecutionWriter writer{out, decoder.clientTag()};
+    WireStatus status = decoder.type() == CommandType::CANCEL
+                            ? WireStatus::CANCELLED
+                            : WireStatus::ACCEPTED;
+    uint64_t orderId = 0;
+    try {
+      orderId = book.execute(
+          decoder.template command<typename Book::Command>(), writer);
+    } catch (const std::exception &) {
+      status = WireStatus::REJECTED;
+    }
+    encodeAck(out.claim(wireHeaderLength + AckDecoder::bodyLength), status,
+              decoder.clientTag(), orderId, writer.count);
+  });
+}